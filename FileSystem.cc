@@ -3,6 +3,21 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
 
 #include <iostream>
 #include <bitset>
@@ -10,6 +25,7 @@
 #include <string>
 #include <algorithm>
 #include <map>
+#include <set>
 #include <queue>
 
 using namespace std;
@@ -20,38 +36,312 @@ using namespace std;
 
 /* -------------------------------- MACROS ---------------------------------- */
 #define MAX_INPUT_LENGTH (1050)  // Maximum length of input
+#define MAX_PAYLOAD_LENGTH (4*MAX_INPUT_LENGTH) // Maximum length of a B command continued over lines
 #define BLOCK_SIZE (1024)        // 1 KB
+#define NUM_BLOCKS (128)         // Blocks on disk, including the superblock
+#define CHECKSUM_MAGIC "CRC32C"  // Marks a valid checksum table block
+#define SLOT_MAP_MAGIC "LZSLOTS" // Ends a compressed disk image, after its slot heap
+#define SLOT_GRANULE (16)        // Slot heap allocation unit in bytes
+#define SLOT_RAW (0x8000)        // Slot length flag: block stored uncompressed
+#define HEAP_OFFSET (3*BLOCK_SIZE) // Start of slot heap in compressed image
+#define TRACE_MAGIC "FSTRACE"    // Marks an I/O trace file
+#define SNAPSHOT_MAGIC "FSSNAP"  // Marks an overlay snapshot file
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int) // Reflink ioctl from linux/fs.h, which clashes with BLOCK_SIZE
+#endif
+#define TRACE_RING_SIZE (4096)   // Trace records buffered before flushing
+#define COMMAND_RING_SIZE (64)   // Parsed commands queued for the executor
+#define OUTPUT_RING_SIZE (256)   // Output records queued for the output thread
+#define MAX_READERS (16)         // Threads that can pin metadata versions
+#define HEAT_DECAY_PERIOD (256)  // File accesses between halvings of access counts
+#define HOT_RESIZES (2)          // Decayed resize count of a frequently resized file
+#define NUM_REGISTERS (64)       // Named buffer registers, @0 to @63
+#define REGISTER_SLAB (16)       // Register blocks allocated together
 
 /* ------------------------- STRUCTURE DEFINITIONS -------------------------- */
+/* Totals for everything below a directory */
+typedef struct {
+  int files;                    // files in directory and its subdirectories
+  int dirs;                     // subdirectories at any depth
+  int blocks;                   // blocks used by those files
+} Usage;
+
 /* Struct for additional info about disk file */
 typedef struct {
   int currWorkDir;                       // current working directory
   string diskName;                       // name of disk file mounted
-	map<int, vector<string> > directories; // key: parent dir num, val: names of items inside
-  map<int, vector<int> > dirChildInodes; // key: parent dir num, val: inode indexes of items inside
+  map<int, map<string, int> > directories; // key: parent dir num, val: inode of each item inside by name
+  map<int, set<int> > dirChildInodes;    // key: parent dir num, val: inodes of items inside, in order
+  map<string, set<int> > nameIndex;      // key: item name, val: inodes of items with that name in any directory
   vector<int> freeInodeIndexes;          // list of free inodes
+  int childCount[128];                   // index: dir inode, val: number of items inside
+  Usage usage[128];                      // index: dir inode, val: totals for its subtree
+  bool compressed;                       // blocks stored in compressed slots
+  unsigned heat[128];                    // index: file inode, val: decayed count of reads and writes
+  unsigned resizes[128];                 // index: file inode, val: decayed count of resizes
+  unsigned heatClock;                    // file accesses counted since mount, for decaying heat
 } Disk;
 
+/* Durability modes controlling when writes to the disk file are synced */
+typedef enum {
+  DURABILITY_NONE,    // never sync; data is as durable as the page cache
+  DURABILITY_COMMAND, // sync after every command that changed the disk
+  DURABILITY_GROUP,   // sync every N commands or T milliseconds
+  DURABILITY_UNMOUNT  // sync once when the disk is unmounted
+} Durability;
+
+/* Struct for durability settings and pending (unsynced) state */
+typedef struct {
+  Durability mode;            // selected durability mode
+  int groupCommands;          // group mode: sync after this many commands (0 = off)
+  int groupMillis;            // group mode: sync after this many ms (0 = off)
+  bool dataDirty;             // blocks written to disk file since last sync
+  Super_block syncedSuper;    // superblock as of last write to disk file
+  int commandsSinceSync;      // commands run since last sync
+  struct timespec lastSync;   // time of last sync
+} SyncState;
+
+/* Checksum table stored in the block following the last disk block */
+typedef struct {
+  char magic[8];                // CHECKSUM_MAGIC if the table is valid
+  uint32_t crc[NUM_BLOCKS];     // CRC32C of each block (index 0 unused)
+} Checksum_block;
+
+/* Location of a block's stored bytes in the slot heap of a compressed image */
+typedef struct {
+  uint16_t offset;              // heap offset in SLOT_GRANULE units
+  uint16_t length;              // stored bytes (0 = zero block), SLOT_RAW if uncompressed
+} Slot;
+
+/* Slot map stored in block 1 of a compressed image */
+typedef struct {
+  char magic[8];                // SLOT_MAP_MAGIC (the image trailer marks it compressed)
+  Slot slot[NUM_BLOCKS];        // slot of each block (index 0 unused)
+} Slot_map;
+
+/* One physical I/O recorded by the tracer */
+typedef struct {
+  uint64_t timestamp;           // ns since tracing started
+  uint32_t offset;              // byte offset in disk file
+  uint32_t bytes;               // bytes transferred
+  uint32_t latency;             // ns spent in the system call
+  char command;                 // command being run ('-' outside commands)
+  char op;                      // 'R' for read, 'W' for write
+  uint8_t inode;                // inode of file accessed, 0xFF if none
+  uint8_t logicalBlock;         // block index within file, 0xFF if none
+} Trace_record;
+
+/* Header at the start of a trace file */
+typedef struct {
+  char magic[8];                // TRACE_MAGIC
+  uint32_t recordSize;          // sizeof(Trace_record)
+  uint32_t reserved;
+} Trace_header;
+
+/* Header at the start of an overlay snapshot file. It is followed by one
+   record per image page changed since the snapshot: the page index (uint32)
+   then the page's contents at snapshot time. */
+typedef struct {
+  char magic[8];                // SNAPSHOT_MAGIC
+  uint32_t imageSize;           // bytes in disk file when snapshot was taken
+  uint32_t reserved;
+} Snapshot_header;
+
+/* Overlay snapshot of the mounted disk that changes are being saved to */
+typedef struct {
+  string path;                  // snapshot file
+  int fd;                       // snapshot file, open for appending
+  off_t imageSize;              // bytes in disk file when snapshot was taken
+  vector<bool> saved;           // index: page of disk file, val: page is in snapshot file
+} Snapshot;
+
+/* Final state of an unmounted disk, written back by the flusher thread */
+typedef struct {
+  int fd;                       // descriptor of the disk file, closed when done
+  dev_t dev;                    // device of the disk file
+  ino_t ino;                    // inode of the disk file
+  bool sync;                    // fdatasync before closing
+  vector<pair<off_t, vector<uint8_t> > > writes; // (offset, bytes) to write, in order
+} Flush_job;
+
+/* Struct for I/O tracing state */
+typedef struct {
+  int fd;                       // trace file, -1 if tracing is off
+  struct timespec start;        // time tracing started
+  Trace_record ring[TRACE_RING_SIZE]; // records not yet flushed
+  int count;                    // number of records in ring
+  char command;                 // command being run
+  int inode;                    // inode of file being accessed, -1 if none
+  int base;                     // block holding logical block 0 of that file, -1 if none
+  dev_t dev;                    // device of the disk file traced
+  ino_t ino;                    // inode of the disk file traced, 0 before the first mount
+} Tracer;
+
+/* Block allocation policies used when placing file blocks */
+typedef enum {
+  ALLOC_FIRST_FIT, // first free run large enough, scanning from block 1
+  ALLOC_NEXT_FIT,  // first free run large enough, scanning from roving pointer
+  ALLOC_BEST_FIT,  // smallest free run large enough
+  ALLOC_WORST_FIT, // largest free run
+  ALLOC_BUDDY      // run aligned to size rounded up to power of two
+} AllocPolicy;
+
+/* Struct for command throughput and latency statistics */
+typedef struct {
+  bool enabled;               // print statistics at exit
+  struct timespec start;      // time first command started
+  vector<double> latencies;   // per command latency in microseconds
+  int syncs;                  // number of fdatasync calls
+  int superblockWrites;       // number of superblock writes
+  long long bytesWritten;     // bytes of block data written to disk files
+  int dedupHits;              // block writes satisfied by an existing slot
+  int dentryHits;             // path lookups answered by the dentry cache
+  int dentryMisses;           // path lookups that searched a directory
+  int idleDefragBlocks;       // blocks moved by idle defragmentation
+  int relocations;            // files moved to another run to grow
+  int checkOnlyCommands;      // commands the peephole pass reduced to their checks
+} Stats;
+
+/* Script command after parsing and validation */
+typedef struct {
+  char op;                      // command letter, 0 if the line is not a valid command
+  int line;                     // line number in input file, 0 at end of input
+  char arg[MAX_INPUT_LENGTH];   // disk, file, directory or snapshot name
+  char arg2[MAX_INPUT_LENGTH];  // second name, for N, I, X and P
+  int number;                   // size or block number
+  int reg;                      // buffer register of B, R and W, -1 for the buffer
+  int length;                   // bytes of data used
+  bool checkOnly;               // effect is redundant, only report errors (see peephole)
+  uint8_t data[BLOCK_SIZE];     // new buffer contents for B
+} Command;
+
+/* Command of the input file, kept when the whole script is read first */
+typedef struct {
+  int line;                     // line number in input file
+  string text;                  // command as read
+  bool checkOnly;               // marked by the peephole pass
+} Script_command;
+
+/* One block of a batched write */
+typedef struct {
+  int block;                    // disk block written
+  int inode;                    // inode of file holding the block
+  int base;                     // disk block holding block 0 of the file
+  const uint8_t *data;          // register written into the block
+} Batch_write;
+
+/* Formatted output waiting to be written by the output thread */
+typedef struct {
+  FILE *stream;                 // stdout or stderr, NULL at end of output
+  int length;                   // bytes used in text
+  char text[MAX_INPUT_LENGTH + 128]; // room for messages quoting a whole input line
+} Output_record;
+
+/* Header of output written by a parallel worker, followed by its text */
+typedef struct {
+  int line;                     // line of the command that output it, INT_MAX after the last command
+  int stream;                   // 1 for stderr, 0 for stdout
+  int length;                   // bytes of text
+} Tagged_output;
+
+/* Buffered output to stdout or stderr */
+typedef struct {
+  int fd;                       // file descriptor written to
+  char *data;                   // bytes not yet written
+  int length;                   // number of bytes in data
+} Out_stream;
+
+/* Indexes of a single producer single consumer ring. Each side only writes
+   its own index, so no locks are needed. */
+typedef struct {
+  unsigned head __attribute__((aligned(64))); // slots filled, advanced by producer
+  unsigned tail __attribute__((aligned(64))); // slots drained, advanced by consumer
+} Ring;
+
+/* Read-only copy of the metadata used by listings and reads. A version is
+   never changed once published; writers publish a new one instead. */
+typedef struct {
+  Super_block superblock;       // inodes and free block list
+  int childCount[128];          // index: dir inode, val: number of items inside
+  Usage usage[128];             // index: dir inode, val: totals for its subtree
+} Meta_version;
+
+/* Epoch pinned by one reader thread, on its own cache line */
+typedef struct {
+  uint64_t epoch __attribute__((aligned(64))); // epoch when pinned, 0 if not reading
+} Reader_slot;
+
 /* ---------------------------- GLOBAL VARIABLES ---------------------------- */
 uint8_t buffer[BLOCK_SIZE];   // buffer of 1KB
+uint8_t *ioBuffer = buffer;   // buffer used by B, R and W, the register named by the command
+uint8_t *registers[NUM_REGISTERS]; // index: register, val: its block, NULL until first used
+vector<uint8_t *> registerSlabs; // slabs register blocks are carved from
+int slabBlocksUsed = REGISTER_SLAB; // blocks handed out from the last slab
 int fsfd;                     // file descriptor of emulator disk file currently mounted
 Super_block superblock;       // superblock of disk file currently mounted
 Disk info;                    // additional information about the disk file
 bool fsMounted = false;       // indicates if a disk is currently mounted
+SyncState syncState = {DURABILITY_NONE, 32, 100}; // durability settings
+Stats stats;                  // throughput and latency statistics
+AllocPolicy allocPolicy = ALLOC_FIRST_FIT; // policy used to place file blocks
+int nextFitBlock = 1;         // roving pointer of next fit allocation
+bool checksumsEnabled = false; // keep and verify per block CRC32C checksums
+bool checksumsDirty = false;  // checksum table changed since last written
+Checksum_block checksums;     // checksum table of disk file currently mounted
+bool compressOnMount = false; // convert uncompressed disks to compressed on mount
+bool slotMapDirty = false;    // slot map changed since last written
+Slot_map slotMap;             // slot map of compressed disk currently mounted
+bool dedupEnabled = false;    // share slots between blocks with identical contents
+map<int, int> slotRefs;       // key: heap offset of slot, val: number of blocks using it
+map<uint32_t, Slot> contentIndex; // key: crc32c of block contents, val: slot holding them
+map<int, uint32_t> slotContent;   // key: heap offset of indexed slot, val: its crc32c
+Tracer tracer = {-1};         // block I/O tracer
+map<pair<int, string>, int> dentryCache; // key: (dir inode, name), val: inode of item, -1 if none
+vector<Snapshot> snapshots;   // overlay snapshots of disk file currently mounted
+bool pipelined = false;       // parse, execute and output on separate threads
+bool outputThreadRunning = false; // output is queued for the output thread
+Ring commandQueue;            // parser to executor ring of commandRing slots
+Command commandRing[COMMAND_RING_SIZE];
+Ring outputQueue;             // executor to output thread ring of outputRing slots
+Output_record outputRing[OUTPUT_RING_SIZE];
+Out_stream outStreams[2] = {{STDOUT_FILENO}, {STDERR_FILENO}}; // stdout, stderr
+int outBufferSize = 65536;    // bytes buffered per stream before writing
+int idleDefragBudget = 0;     // blocks idle defragmentation may move per idle period, 0 if off
+bool heatPlacement = false;   // place files by access heat in defrag and resize
+pthread_mutex_t flushLock = PTHREAD_MUTEX_INITIALIZER; // guards the flush state below
+pthread_cond_t flushCond = PTHREAD_COND_INITIALIZER;   // signalled when a flush job is queued or done
+deque<Flush_job *> flushJobs; // unmounted disks not yet written back, oldest first
+bool flusherRunning = false;  // flusher thread started
+bool flushStop = false;       // flusher thread exits once no jobs are left
+pthread_t flusher;            // flusher thread
+Flush_job *flushCapture = NULL; // job collecting the writes of the disk being unmounted
+Meta_version *currentMeta = NULL; // metadata version published last
+uint64_t metaEpoch = 1;       // advanced each time a version is published
+Reader_slot readerSlots[MAX_READERS]; // epochs pinned by reader threads
+int numReaders = 0;           // reader slots handed out
+__thread int readerSlot = -1; // slot of calling thread, -1 until it first reads
+vector<pair<Meta_version *, uint64_t> > retiredMeta; // replaced versions, with epoch they were replaced in
+int parallelWorkers = 0;      // worker processes running disk streams at once, 0 to run the script in one process
+FILE *workerOutput = NULL;    // tagged output of this worker process, NULL if not a worker
+int workerLine = 0;           // line of the command this worker process is running
+bool optimize = false;        // run the peephole pass over the script before running it
+bool checkOnly = false;       // command being run only reports its errors
+bool createElided = false;    // last C run with checkOnly would have succeeded, so its D does nothing
 
 /* -------------------------- FUNCTION DEFINITIONS -------------------------- */
 /* Helper Functions ----------------------------------------------------------*/
 void tokenize(char* str, const char* delim, char ** argv)
 {
   /* Takes character array and splits into tokens, with splits occuring
-     at delim characters. If first token is "B", we save all characters
+     at delim characters. If first token is "B", or "B" with a register or
+     encoding, we save all characters
      following it to be the second argument.
   */
   char* token;
   token = strtok(str, delim);
 
   // If updating buffer, everything following 'B' is part of input to buffer
-  if (strcmp(token, "B") == 0)
+  if ((token[0] == 'B') && ((token[1] == '\0') || (token[1] == '@') || (token[1] == ':')))
   {
     argv[0] = token;
     token = strtok(NULL, "");
@@ -66,6 +356,138 @@ void tokenize(char* str, const char* delim, char ** argv)
   }
 }
 
+unsigned ringReserve(Ring *ring, unsigned capacity)
+{
+  /* Waits until the ring has a free slot and returns its index. Producer only. */
+  while (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == capacity)
+  {
+    sched_yield();
+  }
+  return ring->head % capacity;
+}
+
+void ringPublish(Ring *ring)
+{
+  /* Hands the reserved slot to the consumer. Producer only. */
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+unsigned ringFront(Ring *ring, unsigned capacity)
+{
+  /* Waits until the ring has a filled slot and returns its index. Consumer only. */
+  while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail)
+  {
+    sched_yield();
+  }
+  return ring->tail % capacity;
+}
+
+bool ringEmpty(Ring *ring)
+{
+  /* Checks if no slot is waiting to be drained, without waiting. Consumer only. */
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail;
+}
+
+void ringPop(Ring *ring)
+{
+  /* Hands the front slot back to the producer. Consumer only. */
+  __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+void outFlushStream(Out_stream *out)
+{
+  /* Writes out all bytes buffered for one stream */
+  int done = 0;
+  while (done < out->length)
+  {
+    int written = write(out->fd, out->data + done, out->length - done);
+    if (written <= 0)
+    {
+      break;
+    }
+    done += written;
+  }
+  out->length = 0;
+}
+
+void outFlush(void)
+{
+  /* Writes out buffered output of both streams, registered to run at exit */
+  outFlushStream(&outStreams[0]);
+  outFlushStream(&outStreams[1]);
+}
+
+void outAppend(FILE *stream, const char *text, int length)
+{
+  /* Adds text to the buffer of stdout or stderr, writing the buffer out when
+     full. Anything buffered for the other stream is written first, so the
+     two stay in order when both go to the same file.
+  */
+  Out_stream *out = &outStreams[stream == stderr];
+  outFlushStream(&outStreams[stream != stderr]);
+
+  if (out->length + length > outBufferSize)
+  {
+    outFlushStream(out);
+  }
+  if (length > outBufferSize)
+  {
+    // Too big to buffer, write it directly
+    Out_stream direct = {out->fd, (char *)text, length};
+    outFlushStream(&direct);
+    return;
+  }
+  if (out->data == NULL)
+  {
+    out->data = (char *)malloc(outBufferSize);
+  }
+  memcpy(out->data + out->length, text, length);
+  out->length += length;
+}
+
+void outWrite(FILE *stream, const char *text, int length)
+{
+  /* Outputs text to stdout or stderr. While the output thread of pipelined
+     mode runs, the text is queued for it instead so it comes out in the
+     order commands ran.
+  */
+  if (workerOutput != NULL)
+  {
+    // Tag with the command's line so the parent can merge streams in order
+    Tagged_output tag = {workerLine, stream == stderr, length};
+    fwrite(&tag, sizeof(Tagged_output), 1, workerOutput);
+    fwrite(text, 1, length, workerOutput);
+    return;
+  }
+  if (!outputThreadRunning)
+  {
+    outAppend(stream, text, length);
+    return;
+  }
+
+  while (length > 0)
+  {
+    Output_record *rec = &outputRing[ringReserve(&outputQueue, OUTPUT_RING_SIZE)];
+    rec->stream = stream;
+    rec->length = min(length, (int)sizeof(rec->text));
+    memcpy(rec->text, text, rec->length);
+    ringPublish(&outputQueue);
+    text += rec->length;
+    length -= rec->length;
+  }
+}
+
+void outPrintf(FILE *stream, const char *format, ...)
+{
+  /* Formats a message and outputs it with outWrite */
+  char text[sizeof(((Output_record *)0)->text)];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  outWrite(stream, text, min(length, (int)sizeof(text) - 1));
+}
+
 bool getFreeBlockBit(int n)
 {
   /* Return bit with index n from the free block list of superblock */
@@ -95,24 +517,19 @@ bool inodeIsDirectory(int inodeIndex)
   return bitset<8>(superblock.inode[inodeIndex].dir_parent)[7];
 }
 
-int getIndexInDir(char name[5])
+int getChildInode(char name[5])
 {
-  /* returns -1 if no dir or file with name is in current directory */
+  /* Returns inode of dir or file with name in current directory, -1 if none */
   char tempName[6] = {name[0], name[1], name[2], name[3], name[4], 0};
-  vector<string>::iterator it = find(info.directories[info.currWorkDir].begin(), info.directories[info.currWorkDir].end(), string(tempName));
+  map<string, int> &names = info.directories[info.currWorkDir];
+  map<string, int>::iterator it = names.find(string(tempName));
 
   // Check if specified file or directory is in current working directory
-  if ( it == info.directories[info.currWorkDir].end() )
+  if ( it == names.end() )
   {
     return -1;
   }
-  return distance(info.directories[info.currWorkDir].begin(), it);
-}
-
-int getInodeIndex(int sharedIdx)
-{
-  /* Returns inode number in superblock given its index in the map */
-  return info.dirChildInodes[info.currWorkDir][sharedIdx];
+  return it->second;
 }
 
 int getFileSize(int inodeIndex)
@@ -127,1227 +544,5420 @@ int getStartBlock(int inodeIndex)
   return (superblock.inode[inodeIndex].start_block);
 }
 
-class cmpStartBlock
+void addUsage(int dir, int files, int dirs, int blocks)
 {
-  /*
-    Comparator class for sorting a priority queue by start_block
-    with smallest start_block first in the queue.
-  */
-  public:
-    bool operator()(int a, int b)
+  /* Adds to the usage totals of directory dir and all its ancestors */
+  while (true)
+  {
+    info.usage[dir].files += files;
+    info.usage[dir].dirs += dirs;
+    info.usage[dir].blocks += blocks;
+    if (dir == 127)
     {
-      return (superblock.inode[a].start_block > superblock.inode[b].start_block);
+      break;
     }
-};
+    dir = superblock.inode[dir].dir_parent & 0x7F;
+  }
+}
 
-/* Required Functions ------------------------------------------------------- */
-void fs_mount(char *new_disk_name)
+void rebuildUsage(void)
 {
-  /* fs_mount performs 6 consistency checks on the disk file provided.
-     Mounts the disk if all checks pass.
-     Input: new_disk_name - name of the disk file being mounted
-     Output: None
-  */
-  // Check for file existence in current directory
-  int fd = open(new_disk_name, O_RDWR);
-
-  if (fd < 0)
+  /* Recomputes the usage totals of every directory from the superblock */
+  memset(info.usage, 0, sizeof(info.usage));
+  for (int i = 0; i < 126; i++)
   {
-    fprintf(stderr, "Error: Cannot find disk %s\n", new_disk_name);
-    return;
+    if (superblock.inode[i].used_size & 0x80)
+    {
+      bool isDir = inodeIsDirectory(i);
+      addUsage(superblock.inode[i].dir_parent & 0x7F, !isDir, isDir, isDir ? 0 : getFileSize(i));
+    }
   }
+}
 
-  // Consistency checks
-  bool consistent = true;
-  Super_block tempSuperblock;
-  Disk tempInfo;
-  int inconsistency = 0;
-
-  read(fd, &(tempSuperblock), BLOCK_SIZE);
+void setFileSize(int inodeIndex, int size)
+{
+  /* Sets size of file of given inode, updating usage of its directories */
+  addUsage(superblock.inode[inodeIndex].dir_parent & 0x7F, 0, 0, size - getFileSize(inodeIndex));
+  superblock.inode[inodeIndex].used_size = size | 0x80;
+}
 
-  /* CONSISTENCY CHECK 1 ---------------------------------------------------- */
-  int freeByteCounter = 0;
-  bitset<8> curByte;
-  while (freeByteCounter < 128)
+uint8_t *registerBuffer(int reg)
+{
+  /* Returns the block of buffer register reg, or the buffer if reg is -1.
+     Register blocks are carved from slabs of REGISTER_SLAB zeroed blocks
+     the first time each register is used.
+  */
+  if (reg < 0)
   {
-    int modCount = freeByteCounter % 8;
-    if (modCount == 0)
+    return buffer;
+  }
+  if (registers[reg] == NULL)
+  {
+    if (slabBlocksUsed == REGISTER_SLAB)
     {
-      curByte = bitset<8>((unsigned char)tempSuperblock.free_block_list[freeByteCounter/8]);
+      registerSlabs.push_back((uint8_t *)calloc(REGISTER_SLAB, BLOCK_SIZE));
+      slabBlocksUsed = 0;
     }
+    registers[reg] = registerSlabs.back() + BLOCK_SIZE*slabBlocksUsed++;
+  }
+  return registers[reg];
+}
 
-    int bitIdx = 7 - modCount;
+bool batchWriteBefore(const Batch_write &a, const Batch_write &b)
+{
+  /* Orders blocks of a batched write by disk block */
+  return a.block < b.block;
+}
 
-    // Superblock must not be free in free_block_list
-    if (freeByteCounter == 0)
+void touchFile(int inodeIndex, unsigned *counts)
+{
+  /* Counts an access to file of given inode in counts (info.heat or
+     info.resizes). Every HEAT_DECAY_PERIOD accesses all counts are halved,
+     so they follow recent use.
+  */
+  counts[inodeIndex]++;
+  if (++info.heatClock % HEAT_DECAY_PERIOD == 0)
+  {
+    for (int i = 0; i < 128; i++)
     {
-      if (curByte[bitIdx])
-      {
-        freeByteCounter++;
-        continue;
-      } else
-      {
-        consistent = false;
-        inconsistency = 1;
-        break;
-      }
+      info.heat[i] /= 2;
+      info.resizes[i] /= 2;
     }
+  }
+}
 
-    // If not looking at superblock bit
-    bool properAlloc = false;
+int addInode(int dir, const char *name, int size, int startBlockIdx)
+{
+  /* Stores a new file of size blocks starting at startBlockIdx, or a
+     directory if size is 0, in the first free inode, as an item called name
+     in directory dir.
+     Output: inode of the new item
+  */
+  Inode tempInode;
+  memset(&tempInode, 0, sizeof(Inode));
+  for (int i = 0; (i < 5) && (name[i] != '\0'); i++)
+  {
+    tempInode.name[i] = name[i];
+  }
+  tempInode.used_size = (uint8_t)size | 0x80;
+  tempInode.dir_parent = (size == 0) ? (dir | 0x80) : (dir & 0x7F);
+  tempInode.start_block = startBlockIdx;
+
+  int inodeIndex = info.freeInodeIndexes[0];
+  superblock.inode[inodeIndex] = tempInode;
+  info.heat[inodeIndex] = 0;
+  info.resizes[inodeIndex] = 0;
+
+  // Update directories info
+  char tempName[6] = {0};
+  strncpy(tempName, name, 5);
+  info.directories[dir][string(tempName)] = inodeIndex;
+  info.dirChildInodes[dir].insert(inodeIndex);
+  info.nameIndex[string(tempName)].insert(inodeIndex);
+  info.childCount[dir]++;
+  dentryCache.erase(make_pair(dir, string(tempName)));
+  addUsage(dir, size != 0, size == 0, size);
+  info.freeInodeIndexes.erase(info.freeInodeIndexes.begin());
+  return inodeIndex;
+}
 
-    // get index range using size and start index indicated in inodes
-    for (int i = 0; i < (int)(sizeof(tempSuperblock.inode)/sizeof(Inode)); i++)
+Meta_version *pinMetadata(void)
+{
+  /* Pins the current epoch for the calling thread and returns the metadata
+     version published last. The version is not freed before unpinMetadata,
+     so it can be read without locks while writers publish newer ones.
+  */
+  if (readerSlot < 0)
+  {
+    readerSlot = __atomic_fetch_add(&numReaders, 1, __ATOMIC_RELAXED);
+    if (readerSlot >= MAX_READERS)
     {
-      int tempUsedSize, lowerLim, upperLim;
-      tempUsedSize = bitset<8>(tempSuperblock.inode[i].used_size & 0x7F).to_ulong();
-      lowerLim = tempSuperblock.inode[i].start_block;
-      if (tempUsedSize > 0)
-      {
-        upperLim = lowerLim + tempUsedSize - 1;
-      } else // could be a directory
-      {
-        upperLim = 0;
-        if (bitset<8>(tempSuperblock.inode[i].dir_parent)[7]) // directory
-        {
-          continue; // skip it as we're checking if marked blocks belong to files
-        }
-      }
-
-      if (curByte[bitIdx]) // block is in use
-      {
-        if ((freeByteCounter >= lowerLim) && (freeByteCounter <= upperLim))
-        {
-          if (!properAlloc)
-          {
-            properAlloc = true;
-          }
-          else // block is used by more than one file
-          {
-            properAlloc = false;
-            break;
-          }
-        }
-      }
-      else // if block is supposed to be free
-      {
-        if ((freeByteCounter >= lowerLim) && (freeByteCounter <= upperLim))
-        {
-          properAlloc = false;
-          break;
-        }
-        else
-        {
-          properAlloc = true;
-        }
-      }
+      outPrintf(stderr, "Error: More than %d threads reading metadata\n", MAX_READERS);
+      exit(1);
     }
+  }
+  // Pinning before loading the pointer means a writer that has not seen the
+  // pin has already replaced the version, so it is never handed out
+  __atomic_store_n(&readerSlots[readerSlot].epoch, __atomic_load_n(&metaEpoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&currentMeta, __ATOMIC_SEQ_CST);
+}
 
-    if (!properAlloc)
+void unpinMetadata(void)
+{
+  /* Ends the read started by pinMetadata */
+  __atomic_store_n(&readerSlots[readerSlot].epoch, 0, __ATOMIC_RELEASE);
+}
+
+void reclaimMetadata(void)
+{
+  /* Frees retired versions that no reader can still hold: those replaced in
+     an epoch no later than the oldest epoch pinned
+  */
+  uint64_t oldest = UINT64_MAX;
+  int readers = min(__atomic_load_n(&numReaders, __ATOMIC_SEQ_CST), MAX_READERS);
+  for (int i = 0; i < readers; i++)
+  {
+    uint64_t epoch = __atomic_load_n(&readerSlots[i].epoch, __ATOMIC_SEQ_CST);
+    if ((epoch != 0) && (epoch < oldest))
     {
-      consistent = false;
-      inconsistency = 1;
-      break;
+      oldest = epoch;
     }
+  }
 
-    freeByteCounter++;
+  int kept = 0;
+  for (int i = 0; i < (int)retiredMeta.size(); i++)
+  {
+    if (retiredMeta[i].second <= oldest)
+    {
+      free(retiredMeta[i].first);
+    }
+    else
+    {
+      retiredMeta[kept++] = retiredMeta[i];
+    }
   }
+  retiredMeta.resize(kept);
+}
 
-  if (!consistent)
+void publishMetadata(void)
+{
+  /* Publishes the metadata of the mounted disk as a new version, if it
+     changed since the last one, and retires the old version
+  */
+  Meta_version *old = currentMeta;
+  if ( (old != NULL) && (memcmp(&old->superblock, &superblock, sizeof(Super_block)) == 0) &&
+       (memcmp(old->childCount, info.childCount, sizeof(info.childCount)) == 0) &&
+       (memcmp(old->usage, info.usage, sizeof(info.usage)) == 0) )
   {
-    fprintf(stderr, "Error: File system in %s is inconsistent (error code: %d)\n", new_disk_name, inconsistency);
-    close(fd);
     return;
   }
 
-  /* CONSISTENCY CHECK 2 ---------------------------------------------------- */
-  // For each dir, check if name already in vector before adding to vector
-  for (int i = 0; i < (int)(sizeof(tempSuperblock.inode)/sizeof(Inode)); i++)
+  Meta_version *meta = (Meta_version *)malloc(sizeof(Meta_version));
+  meta->superblock = superblock;
+  memcpy(meta->childCount, info.childCount, sizeof(info.childCount));
+  memcpy(meta->usage, info.usage, sizeof(info.usage));
+
+  __atomic_store_n(&currentMeta, meta, __ATOMIC_SEQ_CST);
+  uint64_t epoch = __atomic_add_fetch(&metaEpoch, 1, __ATOMIC_SEQ_CST);
+  if (old != NULL)
   {
-    // Check if inode is marked "in use"
-    bitset<8> tempBitset = bitset<8>((int)tempSuperblock.inode[i].used_size);
-    if (tempBitset[7] == 0)
-    {
-      continue;
+    retiredMeta.push_back(make_pair(old, epoch));
+  }
+  reclaimMetadata();
+}
+
+bool validPath(const char *path)
+{
+  /* Checks that every '/' separated name in path is 1 to 5 chars. A leading
+     '/' starts from root, and "/" alone is root itself.
+  */
+  const char *name = (path[0] == '/') ? path + 1 : path;
+  if ((name != path) && (*name == '\0'))
+  {
+    return true;
+  }
+  while (true)
+  {
+    const char *end = strchr(name, '/');
+    int length = (end != NULL) ? (int)(end - name) : (int)strlen(name);
+    if ((length < 1) || (length > 5))
+    {
+      return false;
+    }
+    if (end == NULL)
+    {
+      return true;
     }
+    name = end + 1;
+  }
+}
 
-    // Use a multimap Map<directory number, vector <string>>
-    uint8_t tempDir = tempSuperblock.inode[i].dir_parent & 0x7F;
-    // printf("Using inode %d\n", i);
-    char tempName[6] = {tempSuperblock.inode[i].name[0], tempSuperblock.inode[i].name[1], tempSuperblock.inode[i].name[2], tempSuperblock.inode[i].name[3], tempSuperblock.inode[i].name[4], '\0'};
-    string strName = string(tempName);
+int lookupChild(int dir, const char *name)
+{
+  /* Returns inode of the item called name in directory dir (dir itself for
+     ".", its parent for ".."), or -1 if there is none. Results, including
+     misses, are kept in the dentry cache until the item is created, deleted
+     or another disk is mounted.
+  */
+  if (strcmp(name, ".") == 0)
+  {
+    return dir;
+  }
+  if (strcmp(name, "..") == 0)
+  {
+    return (dir == 127) ? 127 : (superblock.inode[dir].dir_parent & 0x7F);
+  }
 
-    if (tempInfo.directories.find(tempDir) == tempInfo.directories.end())
-    {
-      // add parent directory to map
-      vector<string> vecName;
-      tempInfo.directories[tempDir] = vecName;
-      tempInfo.directories[tempDir].push_back(strName);
+  pair<int, string> key = make_pair(dir, string(name));
+  map<pair<int, string>, int>::iterator cached = dentryCache.find(key);
+  if (cached != dentryCache.end())
+  {
+    stats.dentryHits++;
+    return cached->second;
+  }
+  stats.dentryMisses++;
 
-      vector<int>vecName2;
-      tempInfo.dirChildInodes[tempDir] = vecName2;
-      tempInfo.dirChildInodes[tempDir].push_back(i);
+  int inodeIndex = -1;
+  map<int, map<string, int> >::iterator names = info.directories.find(dir);
+  if (names != info.directories.end())
+  {
+    map<string, int>::iterator it = names->second.find(key.second);
+    if (it != names->second.end())
+    {
+      inodeIndex = it->second;
     }
-    else
+  }
+  dentryCache[key] = inodeIndex;
+  return inodeIndex;
+}
+
+int findItem(Meta_version *meta, int dir, const char *name)
+{
+  /* Returns inode of the item called name in directory dir of metadata
+     version meta, or -1 if there is none. The name is looked up in the name
+     index of the mounted disk, which commands keep in step with the versions
+     they publish, and the item found is checked against meta.
+  */
+  int inodeIndex = lookupChild(dir, name);
+  if ((inodeIndex < 0) || (inodeIndex >= 126))
+  {
+    return -1;
+  }
+  Inode *inode = &meta->superblock.inode[inodeIndex];
+  if ( !(inode->used_size & 0x80) || ((inode->dir_parent & 0x7F) != dir) ||
+       (strncmp(inode->name, name, 5) != 0) )
+  {
+    return -1;
+  }
+  return inodeIndex;
+}
+
+int resolvePath(const char *path, char name[6])
+{
+  /* Walks path from root if it starts with '/', otherwise from the current
+     working directory, through all but its last name, which is copied into
+     name ("" if path is just "/").
+     Output: directory holding the last item, or -1 if a directory on the
+             way does not exist
+  */
+  char tempPath[MAX_INPUT_LENGTH];
+  char *savePtr;
+  strncpy(tempPath, path, MAX_INPUT_LENGTH - 1);
+  tempPath[MAX_INPUT_LENGTH - 1] = '\0';
+  memset(name, 0, 6);
+
+  int dir = (path[0] == '/') ? 127 : info.currWorkDir;
+  for (char *tok = strtok_r(tempPath, "/", &savePtr); tok != NULL; tok = strtok_r(NULL, "/", &savePtr))
+  {
+    if (name[0] != '\0')
     {
-      // parent directory already key; check and append if name not in vector
-      if (find(tempInfo.directories[tempDir].begin(), tempInfo.directories[tempDir].end(), strName) != tempInfo.directories[tempDir].end())
-      {
-        consistent = false;
-        inconsistency = 2;
-        break;
-      }
-      else
+      dir = lookupChild(dir, name);
+      if ((dir < 0) || ((dir != 127) && !inodeIsDirectory(dir)))
       {
-        tempInfo.directories[tempDir].push_back(strName);
-        tempInfo.dirChildInodes[tempDir].push_back(i);
+        return -1;
       }
     }
+    strncpy(name, tok, 6);
   }
-  if (!consistent)
+  return dir;
+}
+
+vector<pair<int, int> > getFreeRuns(void)
+{
+  /* Returns (start block, length) of each maximal run of free blocks in the
+     free block list of superblock, in block order.
+  */
+  vector<pair<int, int> > runs;
+  int runStart = -1;
+  for (int i = 1; i <= NUM_BLOCKS; i++)
   {
-    fprintf(stderr, "Error: File system in %s is inconsistent (error code: %d)\n", new_disk_name, inconsistency);
-    close(fd);
-    return;
+    bool blockFree = (i < NUM_BLOCKS) && !getFreeBlockBit(i);
+    if (blockFree && (runStart < 0))
+    {
+      runStart = i;
+    }
+    else if (!blockFree && (runStart >= 0))
+    {
+      runs.push_back(make_pair(runStart, i - runStart));
+      runStart = -1;
+    }
   }
+  return runs;
+}
 
-  /* CONSISTENCY CHECK 3 ----------------------------------------------------- */
-  vector<int> availableInodes;
-	vector<int> unavailableInodes;
-  for (int i = 0; i < (int)(sizeof(tempSuperblock.inode)/sizeof(Inode)); i++)
+int findFreeRun(int neededBlocks)
+{
+  /* Returns start block of neededBlocks consecutive free blocks chosen with
+     the current allocation policy, or -1 if no such run exists.
+  */
+  vector<pair<int, int> > runs = getFreeRuns();
+  int chosen = -1;
+  int chosenLen = 0;
+
+  if (allocPolicy == ALLOC_NEXT_FIT)
   {
-    // Check if inode is marked "in use"
-    bitset<8> tempBitset = bitset<8>(tempSuperblock.inode[i].used_size);
-    if (tempBitset[7] == 0)
+    // Scan runs from the roving pointer, wrapping around to block 1 once
+    for (int pass = 0; (pass < 2) && (chosen < 0); pass++)
     {
-      // Make sure all members of inode struct are 0
-      if ((tempSuperblock.inode[i].name[0] != 0) ||
-          (tempSuperblock.inode[i].name[1] != 0) ||
-          (tempSuperblock.inode[i].name[2] != 0) ||
-          (tempSuperblock.inode[i].name[3] != 0) ||
-          (tempSuperblock.inode[i].name[4] != 0) ||
-          (tempSuperblock.inode[i].used_size != 0) ||
-          (tempSuperblock.inode[i].start_block != 0) ||
-          (tempSuperblock.inode[i].dir_parent != 0)
-          )
+      for (int i = 0; i < (int)runs.size(); i++)
       {
-          consistent = false;
-          inconsistency = 3;
+        int start = runs[i].first;
+        int end = runs[i].first + runs[i].second;
+        if (pass == 0)
+        {
+          if (end <= nextFitBlock)
+          {
+            continue;
+          }
+          start = max(start, nextFitBlock);
+        }
+        if (end - start >= neededBlocks)
+        {
+          chosen = start;
           break;
+        }
       }
+    }
+    if (chosen >= 0)
+    {
+      nextFitBlock = chosen + neededBlocks;
+    }
+    return chosen;
+  }
 
-      // Add to free inodes list
-      tempInfo.freeInodeIndexes.push_back(i);
+  if (allocPolicy == ALLOC_BUDDY)
+  {
+    // Round up to size class and take an aligned slot in the smallest run holding one
+    int sizeClass = 1;
+    while (sizeClass < neededBlocks)
+    {
+      sizeClass <<= 1;
     }
-    else
+    for (int i = 0; i < (int)runs.size(); i++)
     {
-      if ((tempSuperblock.inode[i].name[0] == 0) &&
-          (tempSuperblock.inode[i].name[1] == 0) &&
-          (tempSuperblock.inode[i].name[2] == 0) &&
-          (tempSuperblock.inode[i].name[3] == 0) &&
-          (tempSuperblock.inode[i].name[4] == 0)
-          )
+      int aligned = ((runs[i].first + sizeClass - 1) / sizeClass) * sizeClass;
+      if ( (aligned + neededBlocks <= runs[i].first + runs[i].second) &&
+           ((chosen < 0) || (runs[i].second < chosenLen)) )
       {
-          consistent = false;
-          inconsistency = 3;
-          break;
+        chosen = aligned;
+        chosenLen = runs[i].second;
       }
-			unavailableInodes.push_back(i);
     }
+    if (chosen >= 0)
+    {
+      return chosen;
+    }
+    // No aligned slot; fall through to best fit
   }
-  if (!consistent)
+
+  for (int i = 0; i < (int)runs.size(); i++)
   {
-    fprintf(stderr, "Error: File system in %s is inconsistent (error code: %d)\n", new_disk_name, inconsistency);
-    close(fd);
-    return;
+    if (runs[i].second < neededBlocks)
+    {
+      continue;
+    }
+    if ( (chosen < 0) ||
+         ((allocPolicy == ALLOC_WORST_FIT) && (runs[i].second > chosenLen)) ||
+         (((allocPolicy == ALLOC_BEST_FIT) || (allocPolicy == ALLOC_BUDDY)) && (runs[i].second < chosenLen)) )
+    {
+      chosen = runs[i].first;
+      chosenLen = runs[i].second;
+      if (allocPolicy == ALLOC_FIRST_FIT)
+      {
+        break;
+      }
+    }
   }
+  return chosen;
+}
 
-  /* CONSISTENCY CHECKS 4, 5, and 6 ----------------------------------------- */
-	for (int i = 0; i < (int)(unavailableInodes.size()); i++)
-	{
-		// Check only for inodes marked "in use"
-		uint8_t tempDirParent = tempSuperblock.inode[unavailableInodes[i]].dir_parent;
-		bitset<8> tempBitset = bitset<8>(tempDirParent);
-		if (!tempBitset[7]) // is file, start_block must be between 1 and 127
-		{
-			if ((tempSuperblock.inode[unavailableInodes[i]].start_block < 1) ||
-					(tempSuperblock.inode[unavailableInodes[i]].start_block > 127))
-			{
-				consistent = false;
-				inconsistency = 4;
-				break;
-			}
-		}
-		else // is dir, size and start_block must both be 0
-		{
-			if ( ((tempSuperblock.inode[unavailableInodes[i]].used_size & 0x7F) != 0) ||
-					 (tempSuperblock.inode[unavailableInodes[i]].start_block != 0))
-			{
-				consistent = false;
-				inconsistency = 5;
-			}
-		}
+uint32_t crc32cSoftware(uint32_t crc, const uint8_t *data, size_t len)
+{
+  /* Portable CRC32C (Castagnoli), slicing by 8 bytes at a time */
+  static uint32_t table[8][256];
+  static bool tableReady = false;
+  if (!tableReady)
+  {
+    for (int i = 0; i < 256; i++)
+    {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+      {
+        c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+      }
+      table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++)
+    {
+      for (int t = 1; t < 8; t++)
+      {
+        table[t][i] = (table[t-1][i] >> 8) ^ table[0][table[t-1][i] & 0xFF];
+      }
+    }
+    tableReady = true;
+  }
 
-		int tempParentNodeIdx = (int) (tempDirParent & 0x7F);
-		if ( (tempParentNodeIdx != 127) && ( (tempParentNodeIdx < 0) || (tempParentNodeIdx > 125) ) )
-		{
-			// Not valid parent inode index
-		  consistent = false;
-		  if (inconsistency == 0)
-		  {
-		    inconsistency = 6;
-		  }
-		}
-		else if ( (tempParentNodeIdx != 127) && ( (tempParentNodeIdx >= 0) || (tempParentNodeIdx <= 125) ) )
-		{
-			// Check if parent inode is in use and marked as directory
-		  bitset<8> tempParentDirParent = bitset<8>((int)tempSuperblock.inode[tempParentNodeIdx].dir_parent);
-		  bitset<8> tempParentUsedSize = bitset<8>((int)tempSuperblock.inode[tempParentNodeIdx].used_size);
+  while (len >= 8)
+  {
+    uint32_t lo = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24));
+    crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^
+          table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+          table[3][data[4]] ^ table[2][data[5]] ^ table[1][data[6]] ^ table[0][data[7]];
+    data += 8;
+    len -= 8;
+  }
+  while (len-- > 0)
+  {
+    crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xFF];
+  }
+  return crc;
+}
 
-		  if ( (!tempParentDirParent[7]) || (!tempParentUsedSize[7]) )
-		  {
-		    consistent = false;
-        if (inconsistency == 0)
-        {
-          inconsistency = 6;
-        }
-		  }
-		}
-	}
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(uint32_t crc, const uint8_t *data, size_t len)
+{
+  /* CRC32C using the SSE4.2 crc32 instruction, 8 bytes at a time */
+  uint64_t crc64 = crc;
+  while (len >= 8)
+  {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    len -= 8;
+  }
+  crc = (uint32_t)crc64;
+  while (len-- > 0)
+  {
+    crc = _mm_crc32_u8(crc, *data++);
+  }
+  return crc;
+}
+#endif
 
-	if (!consistent)
-	{
-		fprintf(stderr, "Error: File system in %s is inconsistent (error code: %d)\n", new_disk_name, inconsistency);
-		close(fd);
-		return;
-	}
+uint32_t crc32c(const void *data, size_t len)
+{
+  /* Returns CRC32C of data, using the hardware instruction when available */
+#if defined(__x86_64__)
+  static bool hardware = __builtin_cpu_supports("sse4.2");
+  if (hardware)
+  {
+    return ~crc32cHardware(0xFFFFFFFF, (const uint8_t *)data, len);
+  }
+#endif
+  return ~crc32cSoftware(0xFFFFFFFF, (const uint8_t *)data, len);
+}
 
-  // Mount that sucker
-  if (fsMounted)
+int hexValue(char c)
+{
+  /* Returns value of hex digit c, or -1 if c is not one */
+  if ((c >= '0') && (c <= '9'))
   {
-    lseek(fsfd, 0, SEEK_SET);
-    write(fsfd, &superblock, BLOCK_SIZE);
-    close(fsfd);
+    return c - '0';
   }
+  c |= 0x20;
+  return ((c >= 'a') && (c <= 'f')) ? c - 'a' + 10 : -1;
+}
 
-  superblock = tempSuperblock;
-	lseek(fd, 0, SEEK_SET); // return fp to point to beginning of file because why not?
-  dup2(fd, fsfd);
-  fsMounted = true;
-  tempInfo.currWorkDir = 127; // set working directory to root
-  tempInfo.diskName = string(new_disk_name);
-  info = tempInfo;
+int base64Value(char c)
+{
+  /* Returns value of base64 digit c, or -1 if c is not one */
+  if ((c >= 'A') && (c <= 'Z'))
+  {
+    return c - 'A';
+  }
+  if ((c >= 'a') && (c <= 'z'))
+  {
+    return c - 'a' + 26;
+  }
+  if ((c >= '0') && (c <= '9'))
+  {
+    return c - '0' + 52;
+  }
+  return (c == '+') ? 62 : (c == '/') ? 63 : -1;
+}
 
-	close(fd); // close temp fp
+#if defined(__x86_64__)
+__m128i inRange(__m128i c, char low, char high)
+{
+  /* Marks bytes of c in [low, high] with 0xFF, for ASCII low and high */
+  return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(low - 1)),
+                       _mm_cmpgt_epi8(_mm_set1_epi8(high + 1), c));
+}
+#endif
+
+bool decodeHex(const char *text, int length, uint8_t *out)
+{
+  /* Decodes length hex digits (an even number) from text into length/2
+     bytes of out, 16 digits at a time with SSE2 when available.
+     Output: false if text holds something other than hex digits
+  */
+  int i = 0;
+#if defined(__x86_64__)
+  for (; i + 16 <= length; i += 16)
+  {
+    __m128i c = _mm_loadu_si128((const __m128i *)&text[i]);
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i digit = inRange(c, '0', '9');
+    __m128i letter = inRange(lower, 'a', 'f');
+    if (_mm_movemask_epi8(_mm_or_si128(digit, letter)) != 0xFFFF)
+    {
+      return false;
+    }
+    __m128i value = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                                 _mm_and_si128(letter, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
 
+    // Each 16 bit lane holds a high digit then a low digit
+    __m128i bytes = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(value, _mm_set1_epi16(0xFF)), 4),
+                                 _mm_srli_epi16(value, 8));
+    _mm_storel_epi64((__m128i *)&out[i/2], _mm_packus_epi16(bytes, bytes));
+  }
+#endif
+  for (; i < length; i += 2)
+  {
+    int high = hexValue(text[i]);
+    int low = hexValue(text[i+1]);
+    if ((high < 0) || (low < 0))
+    {
+      return false;
+    }
+    out[i/2] = (uint8_t)((high << 4) | low);
+  }
+  return true;
 }
 
-void fs_create(char name[5], int size)
+bool decodeBase64(const char *text, int length, uint8_t *out)
 {
-  /* fs_create creates a file of a given size. If the given size is 0, it
-     creates a directory. When creating a file, we use the first available
-     inode to store the attributes.
-     Input: name - name of the directory or file being mounted
-            size - size of the file. If 0, creating a directory.
+  /* Decodes length base64 digits (a multiple of 4, the last group possibly
+     padded with '=') from text into out, 16 digits at a time with SSE2 when
+     available.
+     Output: false if text is not valid base64
+  */
+  int i = 0;
+#if defined(__x86_64__)
+  // Groups before the last one have no padding
+  for (; i + 16 <= length - 4; i += 16)
+  {
+    __m128i c = _mm_loadu_si128((const __m128i *)&text[i]);
+    __m128i upper = inRange(c, 'A', 'Z');
+    __m128i lower = inRange(c, 'a', 'z');
+    __m128i digit = inRange(c, '0', '9');
+    __m128i plus = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+    __m128i slash = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+    if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, _mm_or_si128(plus, slash)))) != 0xFFFF)
+    {
+      return false;
+    }
+    __m128i value = _mm_or_si128(_mm_and_si128(upper, _mm_sub_epi8(c, _mm_set1_epi8('A'))),
+                    _mm_or_si128(_mm_and_si128(lower, _mm_sub_epi8(c, _mm_set1_epi8('a' - 26))),
+                    _mm_or_si128(_mm_and_si128(digit, _mm_add_epi8(c, _mm_set1_epi8(52 - '0'))),
+                    _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(62)), _mm_and_si128(slash, _mm_set1_epi8(63))))));
+
+    // Merge pairs of 6 bit values into 12 bits, then pairs of those into
+    // the 24 bits of each group of 4 digits
+    value = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(value, _mm_set1_epi16(0xFF)), 6),
+                         _mm_srli_epi16(value, 8));
+    value = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(value, _mm_set1_epi32(0xFFFF)), 12),
+                         _mm_srli_epi32(value, 16));
+    uint32_t groups[4];
+    _mm_storeu_si128((__m128i *)groups, value);
+    for (int g = 0; g < 4; g++)
+    {
+      uint8_t *to = &out[(i/4 + g)*3];
+      to[0] = (uint8_t)(groups[g] >> 16);
+      to[1] = (uint8_t)(groups[g] >> 8);
+      to[2] = (uint8_t)groups[g];
+    }
+  }
+#endif
+  for (; i < length; i += 4)
+  {
+    // Only the last group may end in one or two '='
+    int pad = (i + 4 == length) ? (text[i+3] == '=') + ((text[i+3] == '=') && (text[i+2] == '=')) : 0;
+    uint32_t group = 0;
+    for (int j = 0; j < 4; j++)
+    {
+      int value = (j < 4 - pad) ? base64Value(text[i+j]) : 0;
+      if (value < 0)
+      {
+        return false;
+      }
+      group = (group << 6) | value;
+    }
+    for (int j = 0; j < 3 - pad; j++)
+    {
+      out[i/4*3 + j] = (uint8_t)(group >> (16 - 8*j));
+    }
+  }
+  return true;
+}
+
+int decodePayload(const char *encoding, const char *text, uint8_t out[BLOCK_SIZE])
+{
+  /* Decodes a B payload given in encoding "hex" or "b64" into out,
+     ignoring whitespace.
+     Output: number of bytes decoded, or -1 if text is not valid in the
+             encoding or decodes to more than BLOCK_SIZE bytes
+  */
+  string digits;
+  for (int i = 0; text[i] != '\0'; i++)
+  {
+    if (!isspace((unsigned char)text[i]))
+    {
+      digits.push_back(text[i]);
+    }
+  }
+  int length = digits.size();
+
+  if (strcmp(encoding, "hex") == 0)
+  {
+    if ((length % 2 != 0) || (length/2 > BLOCK_SIZE) || !decodeHex(digits.data(), length, out))
+    {
+      return -1;
+    }
+    return length/2;
+  }
+
+  if ((strcmp(encoding, "b64") != 0) || (length % 4 != 0))
+  {
+    return -1;
+  }
+  int pad = (length > 0) ? (digits[length-1] == '=') + ((digits[length-1] == '=') && (digits[length-2] == '=')) : 0;
+  if ((length/4*3 - pad > BLOCK_SIZE) || !decodeBase64(digits.data(), length, out))
+  {
+    return -1;
+  }
+  return length/4*3 - pad;
+}
+
+double elapsedMillis(struct timespec from, struct timespec to)
+{
+  /* Returns milliseconds elapsed between two monotonic timestamps */
+  return (to.tv_sec - from.tv_sec) * 1000.0 + (to.tv_nsec - from.tv_nsec) / 1000000.0;
+}
+
+void traceFlush(void)
+{
+  /* Appends buffered trace records to the trace file */
+  if ((tracer.fd >= 0) && (tracer.count > 0))
+  {
+    write(tracer.fd, tracer.ring, tracer.count*sizeof(Trace_record));
+  }
+  tracer.count = 0;
+}
+
+void traceFile(int inodeIndex, int base)
+{
+  /* Sets file whose blocks are accessed next: its inode, and the disk block
+     holding its logical block 0 (-1 if unknown)
+  */
+  tracer.inode = inodeIndex;
+  tracer.base = base;
+}
+
+void traceDisk(const char *diskName, const struct stat *diskStat)
+{
+  /* Takes the disk file being mounted as the one traced, or stops tracing
+     if another disk file was traced before: replay applies a whole trace to
+     one image, so a trace holds the I/O of a single disk.
+  */
+  if (tracer.ino == 0)
+  {
+    tracer.dev = diskStat->st_dev;
+    tracer.ino = diskStat->st_ino;
+  }
+  else if ((tracer.dev != diskStat->st_dev) || (tracer.ino != diskStat->st_ino))
+  {
+    outPrintf(stderr, "Error: Stopped tracing at disk %s, a trace holds one disk\n", diskName);
+    traceFlush();
+    close(tracer.fd);
+    tracer.fd = -1;
+  }
+}
+
+void traceRecord(char op, off_t offset, int bytes, int blockIdx, struct timespec before)
+{
+  /* Adds a record of one physical I/O to the trace ring, flushing it when full */
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  Trace_record *rec = &tracer.ring[tracer.count++];
+  rec->timestamp = (uint64_t)(elapsedMillis(tracer.start, before) * 1000000.0);
+  rec->latency = (uint32_t)(elapsedMillis(before, now) * 1000000.0);
+  rec->offset = offset;
+  rec->bytes = bytes;
+  rec->command = tracer.command ? tracer.command : '-';
+  rec->op = op;
+  rec->inode = (tracer.inode >= 0) ? tracer.inode : 0xFF;
+  rec->logicalBlock = ((tracer.base >= 0) && (blockIdx >= tracer.base)) ? blockIdx - tracer.base : 0xFF;
+
+  if (tracer.count == TRACE_RING_SIZE)
+  {
+    traceFlush();
+  }
+}
+
+int diskRead(void *buff, int bytes, off_t offset, int blockIdx)
+{
+  /* Reads bytes at offset of the mounted disk file, tracing the access.
+     blockIdx is the first disk block read, or -1 for metadata.
+  */
+  struct timespec before;
+  if (tracer.fd >= 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &before);
+  }
+  int result = pread(fsfd, buff, bytes, offset);
+  if (tracer.fd >= 0)
+  {
+    traceRecord('R', offset, bytes, blockIdx, before);
+  }
+  return result;
+}
+
+void preservePages(off_t offset, off_t bytes)
+{
+  /* Before bytes at offset of the mounted disk file change, appends the
+     pages holding them to every overlay snapshot that does not have them yet.
+     Pages past the end of the disk file at snapshot time are left out, since
+     rolling back truncates the file.
+  */
+  for (int i = 0; i < (int)snapshots.size(); i++)
+  {
+    Snapshot *snap = &snapshots[i];
+    int lastPage = min(offset + bytes, snap->imageSize) - 1;
+    for (int page = offset / BLOCK_SIZE; page * BLOCK_SIZE <= lastPage; page++)
+    {
+      if (page >= (int)snap->saved.size())
+      {
+        snap->saved.resize(page + 1, false);
+      }
+      if (snap->saved[page])
+      {
+        continue;
+      }
+
+      uint8_t record[sizeof(uint32_t) + BLOCK_SIZE] = {0};
+      uint32_t pageIdx = page;
+      memcpy(record, &pageIdx, sizeof(uint32_t));
+      diskRead(record + sizeof(uint32_t), BLOCK_SIZE, (off_t)page * BLOCK_SIZE, -1);
+      if (write(snap->fd, record, sizeof(record)) != (int)sizeof(record))
+      {
+        outPrintf(stderr, "Error: Cannot save to snapshot %s\n", snap->path.c_str());
+        continue;
+      }
+      snap->saved[page] = true;
+    }
+  }
+}
+
+int diskWrite(const void *buff, int bytes, off_t offset, int blockIdx)
+{
+  /* Writes bytes at offset of the mounted disk file, tracing the access.
+     blockIdx is the first disk block written, or -1 for metadata.
+  */
+  if (!snapshots.empty())
+  {
+    preservePages(offset, bytes);
+  }
+
+  if (flushCapture != NULL)
+  {
+    // Disk is being unmounted; the flusher thread makes this write
+    const uint8_t *data = (const uint8_t *)buff;
+    flushCapture->writes.push_back(make_pair(offset, vector<uint8_t>(data, data + bytes)));
+    return bytes;
+  }
+
+  struct timespec before;
+  if (tracer.fd >= 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &before);
+  }
+  int result = pwrite(fsfd, buff, bytes, offset);
+  if (tracer.fd >= 0)
+  {
+    traceRecord('W', offset, bytes, blockIdx, before);
+  }
+  syncState.dataDirty = true;
+  return result;
+}
+
+int diskWritev(const struct iovec *iov, int count, off_t offset, int blockIdx)
+{
+  /* Writes the count buffers of iov one after another at offset of the
+     mounted disk file with a single write, tracing the access. blockIdx is
+     the first disk block written.
+  */
+  int bytes = 0;
+  for (int i = 0; i < count; i++)
+  {
+    bytes += iov[i].iov_len;
+  }
+  if (!snapshots.empty())
+  {
+    preservePages(offset, bytes);
+  }
+
+  if (flushCapture != NULL)
+  {
+    // Disk is being unmounted; the flusher thread makes these writes
+    for (int i = 0; i < count; i++)
+    {
+      const uint8_t *data = (const uint8_t *)iov[i].iov_base;
+      flushCapture->writes.push_back(make_pair(offset, vector<uint8_t>(data, data + iov[i].iov_len)));
+      offset += iov[i].iov_len;
+    }
+    return bytes;
+  }
+
+  struct timespec before;
+  if (tracer.fd >= 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &before);
+  }
+  int result = pwritev(fsfd, iov, count, offset);
+  if (tracer.fd >= 0)
+  {
+    traceRecord('W', offset, bytes, blockIdx, before);
+  }
+  syncState.dataDirty = true;
+  return result;
+}
+
+bool copyRange(int fromFd, off_t fromOffset, int toFd, off_t toOffset, off_t bytes)
+{
+  /* Copies bytes at fromOffset of file fromFd to toOffset of file toFd inside
+     the kernel, with copy_file_range, or with sendfile between files it
+     cannot copy between (e.g. on different file systems).
+     Output: false if the copy failed
+  */
+  while (bytes > 0)
+  {
+    ssize_t copied = copy_file_range(fromFd, &fromOffset, toFd, &toOffset, bytes, 0);
+    if (copied <= 0)
+    {
+      // sendfile writes at the file position of toFd
+      if (lseek(toFd, toOffset, SEEK_SET) != toOffset)
+      {
+        return false;
+      }
+      copied = sendfile(toFd, fromFd, &fromOffset, bytes);
+      if (copied <= 0)
+      {
+        return false;
+      }
+      toOffset += copied;
+    }
+    bytes -= copied;
+  }
+  return true;
+}
+
+bool diskCopyIn(int hostFd, off_t bytes, off_t offset, int blockIdx)
+{
+  /* Copies the first bytes of host file hostFd to offset of the mounted disk
+     file without passing them through user space, tracing the access like
+     diskWrite.
+  */
+  if (!snapshots.empty())
+  {
+    preservePages(offset, bytes);
+  }
+
+  struct timespec before;
+  if (tracer.fd >= 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &before);
+  }
+  bool result = copyRange(hostFd, 0, fsfd, offset, bytes);
+  if (tracer.fd >= 0)
+  {
+    traceRecord('W', offset, bytes, blockIdx, before);
+  }
+  syncState.dataDirty = true;
+  return result;
+}
+
+bool diskCopyOut(int hostFd, off_t bytes, off_t offset, int blockIdx)
+{
+  /* Copies bytes at offset of the mounted disk file to the start of host
+     file hostFd without passing them through user space, tracing the access
+     like diskRead.
+  */
+  struct timespec before;
+  if (tracer.fd >= 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &before);
+  }
+  bool result = copyRange(fsfd, offset, hostFd, 0, bytes);
+  if (tracer.fd >= 0)
+  {
+    traceRecord('R', offset, bytes, blockIdx, before);
+  }
+  return result;
+}
+
+bool diskCopy(off_t fromOffset, off_t toOffset, off_t bytes, int blockIdx)
+{
+  /* Copies bytes at fromOffset of the mounted disk file to toOffset, which
+     must not overlap them, without passing them through user space, tracing
+     the access like diskWrite.
+  */
+  if (!snapshots.empty())
+  {
+    preservePages(toOffset, bytes);
+  }
+
+  struct timespec before;
+  if (tracer.fd >= 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &before);
+  }
+  bool result = copyRange(fsfd, fromOffset, fsfd, toOffset, bytes);
+  if (tracer.fd >= 0)
+  {
+    traceRecord('W', toOffset, bytes, blockIdx, before);
+  }
+  syncState.dataDirty = true;
+  return result;
+}
+
+int lzEmit(uint8_t *dst, int op, int dstCap, const uint8_t *lit, int litLen, int offset, int matchLen)
+{
+  /* Appends one sequence (token, literals, match offset and length) to dst.
+     A matchLen of 0 emits the final, literals only sequence. Returns the new
+     output length, or -1 if dstCap would be exceeded.
+  */
+  if (op + 1 + litLen + litLen/255 + 1 + 2 + matchLen/255 + 1 > dstCap)
+  {
+    return -1;
+  }
+
+  int matchCode = (matchLen > 0) ? min(matchLen - 4, 15) : 0;
+  dst[op++] = (min(litLen, 15) << 4) | matchCode;
+  if (litLen >= 15)
+  {
+    int rest = litLen - 15;
+    for (; rest >= 255; rest -= 255)
+    {
+      dst[op++] = 255;
+    }
+    dst[op++] = rest;
+  }
+  memcpy(dst + op, lit, litLen);
+  op += litLen;
+
+  if (matchLen > 0)
+  {
+    dst[op++] = offset & 0xFF;
+    dst[op++] = offset >> 8;
+    if (matchLen - 4 >= 15)
+    {
+      int rest = matchLen - 4 - 15;
+      for (; rest >= 255; rest -= 255)
+      {
+        dst[op++] = 255;
+      }
+      dst[op++] = rest;
+    }
+  }
+  return op;
+}
+
+int lzCompress(const uint8_t *src, int srcLen, uint8_t *dst, int dstCap)
+{
+  /* Compresses src with a byte oriented LZ77 codec in the style of LZ4: each
+     sequence is a token, literals, a 16 bit match offset and a match length.
+     Matches are found through a hash table of 4 byte prefixes. Returns the
+     compressed length, or -1 if it does not fit in dstCap bytes.
+  */
+  int table[1 << 12];
+  for (int i = 0; i < (1 << 12); i++)
+  {
+    table[i] = -1;
+  }
+
+  int ip = 0, anchor = 0, op = 0;
+  while (ip + 4 <= srcLen)
+  {
+    uint32_t seq;
+    memcpy(&seq, src + ip, 4);
+    int h = (seq * 2654435761u) >> 20;
+    int ref = table[h];
+    table[h] = ip;
+
+    if ((ref < 0) || (ip - ref > 0xFFFF) || (memcmp(src + ref, src + ip, 4) != 0))
+    {
+      ip++;
+      continue;
+    }
+
+    int matchLen = 4;
+    while ((ip + matchLen < srcLen) && (src[ref + matchLen] == src[ip + matchLen]))
+    {
+      matchLen++;
+    }
+    op = lzEmit(dst, op, dstCap, src + anchor, ip - anchor, ip - ref, matchLen);
+    if (op < 0)
+    {
+      return -1;
+    }
+    ip += matchLen;
+    anchor = ip;
+  }
+  return lzEmit(dst, op, dstCap, src + anchor, srcLen - anchor, 0, 0);
+}
+
+int lzDecompress(const uint8_t *src, int srcLen, uint8_t *dst, int dstLen)
+{
+  /* Decompresses output of lzCompress into dst. Returns the decompressed
+     length, or -1 if src is malformed or would overflow dstLen.
+  */
+  int ip = 0, op = 0;
+  while (ip < srcLen)
+  {
+    int token = src[ip++];
+    int litLen = token >> 4;
+    if (litLen == 15)
+    {
+      int b;
+      do
+      {
+        if (ip >= srcLen)
+        {
+          return -1;
+        }
+        b = src[ip++];
+        litLen += b;
+      } while (b == 255);
+    }
+    if ((ip + litLen > srcLen) || (op + litLen > dstLen))
+    {
+      return -1;
+    }
+    memcpy(dst + op, src + ip, litLen);
+    ip += litLen;
+    op += litLen;
+
+    if (ip == srcLen) // final sequence has no match
+    {
+      break;
+    }
+
+    if (ip + 2 > srcLen)
+    {
+      return -1;
+    }
+    int offset = src[ip] | (src[ip+1] << 8);
+    ip += 2;
+    int matchLen = (token & 0x0F) + 4;
+    if ((token & 0x0F) == 15)
+    {
+      int b;
+      do
+      {
+        if (ip >= srcLen)
+        {
+          return -1;
+        }
+        b = src[ip++];
+        matchLen += b;
+      } while (b == 255);
+    }
+    if ((offset == 0) || (offset > op) || (op + matchLen > dstLen))
+    {
+      return -1;
+    }
+    for (int i = 0; i < matchLen; i++, op++)
+    {
+      dst[op] = dst[op - offset];
+    }
+  }
+  return op;
+}
+
+int slotBytes(Slot slot)
+{
+  /* Returns number of bytes stored in the heap for slot */
+  return slot.length & ~SLOT_RAW;
+}
+
+int slotGranules(Slot slot)
+{
+  /* Returns number of heap granules taken by slot */
+  return (slotBytes(slot) + SLOT_GRANULE - 1) / SLOT_GRANULE;
+}
+
+void setSlot(int blockIdx, Slot slot)
+{
+  /* Points block blockIdx at slot, keeping slot reference counts and the
+     content index up to date. A slot no longer used by any block is free.
+  */
+  Slot oldSlot = slotMap.slot[blockIdx];
+  if ((slotBytes(oldSlot) > 0) && (--slotRefs[oldSlot.offset] == 0))
+  {
+    slotRefs.erase(oldSlot.offset);
+    map<int, uint32_t>::iterator it = slotContent.find(oldSlot.offset);
+    if (it != slotContent.end())
+    {
+      if (contentIndex.count(it->second) && (contentIndex[it->second].offset == oldSlot.offset))
+      {
+        contentIndex.erase(it->second);
+      }
+      slotContent.erase(it);
+    }
+  }
+  if (slotBytes(slot) > 0)
+  {
+    slotRefs[slot.offset]++;
+  }
+  slotMap.slot[blockIdx] = slot;
+  slotMapDirty = true;
+}
+
+int allocSlot(int granules, int exclude)
+{
+  /* Returns heap offset (in granules) of the first gap of at least granules
+     between the slots in use, ignoring the slot of block exclude.
+  */
+  vector<pair<int, int> > used;
+  for (int i = 1; i < NUM_BLOCKS; i++)
+  {
+    if ((i != exclude) && (slotBytes(slotMap.slot[i]) > 0))
+    {
+      used.push_back(make_pair(slotMap.slot[i].offset, slotGranules(slotMap.slot[i])));
+    }
+  }
+  sort(used.begin(), used.end());
+
+  int offset = 0;
+  for (int i = 0; i < (int)used.size(); i++)
+  {
+    if (used[i].first - offset >= granules)
+    {
+      break;
+    }
+    offset = max(offset, used[i].first + used[i].second);
+  }
+  return offset;
+}
+
+int heapEnd(void)
+{
+  /* Returns end of the last slot in use in the heap, in granules */
+  int end = 0;
+  for (int i = 1; i < NUM_BLOCKS; i++)
+  {
+    if (slotBytes(slotMap.slot[i]) > 0)
+    {
+      end = max(end, slotMap.slot[i].offset + slotGranules(slotMap.slot[i]));
+    }
+  }
+  return end;
+}
+
+bool blockIsZero(const uint8_t *data)
+{
+  /* Checks if a block holds only zero bytes */
+  static const uint8_t zeros[BLOCK_SIZE] = {0};
+  return memcmp(data, zeros, BLOCK_SIZE) == 0;
+}
+
+void readSlot(Slot slot, uint8_t *data, int blockIdx)
+{
+  /* Reads and decompresses slot into data. Slots that fail to decompress read
+     as zeros and, unless blockIdx is -1, are reported as corrupt. blockIdx is
+     the block read, for tracing (-1 if none).
+  */
+  if (slotBytes(slot) == 0)
+  {
+    memset(data, 0, BLOCK_SIZE);
+    return;
+  }
+
+  if (slot.length & SLOT_RAW)
+  {
+    diskRead(data, BLOCK_SIZE, HEAP_OFFSET + slot.offset*SLOT_GRANULE, blockIdx);
+    return;
+  }
+
+  uint8_t packed[BLOCK_SIZE];
+  diskRead(packed, slotBytes(slot), HEAP_OFFSET + slot.offset*SLOT_GRANULE, blockIdx);
+  if (lzDecompress(packed, slotBytes(slot), data, BLOCK_SIZE) != BLOCK_SIZE)
+  {
+    memset(data, 0, BLOCK_SIZE);
+    if (blockIdx >= 0)
+    {
+      outPrintf(stderr, "Error: Block %d of disk %s is corrupt\n", blockIdx, info.diskName.c_str());
+    }
+  }
+}
+
+void storeSlot(int blockIdx, const uint8_t *data)
+{
+  /* Compresses block data into the slot of block blockIdx. Zero blocks take
+     no heap space. With dedup, data already stored in another slot just
+     shares that slot. The old slot is rewritten in place only if no other
+     block shares it and the data still fits (copy on write otherwise).
+  */
+  Slot newSlot = {0, 0};
+  uint8_t packed[BLOCK_SIZE];
+  uint32_t contentCrc = 0;
+
+  if (blockIsZero(data))
+  {
+    setSlot(blockIdx, newSlot);
+    return;
+  }
+
+  if (dedupEnabled)
+  {
+    contentCrc = crc32c(data, BLOCK_SIZE);
+    map<uint32_t, Slot>::iterator it = contentIndex.find(contentCrc);
+    if (it != contentIndex.end())
+    {
+      uint8_t stored[BLOCK_SIZE];
+      readSlot(it->second, stored, -1);
+      if (memcmp(stored, data, BLOCK_SIZE) == 0)
+      {
+        Slot curSlot = slotMap.slot[blockIdx];
+        if ((slotBytes(curSlot) == 0) || (curSlot.offset != it->second.offset))
+        {
+          setSlot(blockIdx, it->second);
+        }
+        stats.dedupHits++;
+        return;
+      }
+    }
+  }
+
+  int packedLen = lzCompress(data, BLOCK_SIZE, packed, BLOCK_SIZE - 1);
+  if (packedLen < 0)
+  {
+    memcpy(packed, data, BLOCK_SIZE);
+    newSlot.length = BLOCK_SIZE | SLOT_RAW;
+  }
+  else
+  {
+    newSlot.length = packedLen;
+  }
+
+  Slot oldSlot = slotMap.slot[blockIdx];
+  bool exclusive = (slotBytes(oldSlot) > 0) && (slotRefs[oldSlot.offset] == 1);
+  if (exclusive && (slotGranules(newSlot) <= slotGranules(oldSlot)))
+  {
+    newSlot.offset = oldSlot.offset;
+  }
+  else
+  {
+    newSlot.offset = allocSlot(slotGranules(newSlot), exclusive ? blockIdx : -1);
+  }
+  diskWrite(packed, slotBytes(newSlot), HEAP_OFFSET + newSlot.offset*SLOT_GRANULE, blockIdx);
+  stats.bytesWritten += slotBytes(newSlot);
+
+  setSlot(blockIdx, newSlot);
+  if (dedupEnabled)
+  {
+    contentIndex[contentCrc] = newSlot;
+    slotContent[newSlot.offset] = contentCrc;
+  }
+}
+
+void loadSlot(int blockIdx, uint8_t *data)
+{
+  /* Reads and decompresses the slot of block blockIdx into data */
+  readSlot(slotMap.slot[blockIdx], data, blockIdx);
+}
+
+void buildSlotIndex(void)
+{
+  /* Rebuilds slot reference counts from the slot map and, with dedup, the
+     content index of every slot in use.
+  */
+  slotRefs.clear();
+  contentIndex.clear();
+  slotContent.clear();
+  for (int i = 1; i < NUM_BLOCKS; i++)
+  {
+    Slot slot = slotMap.slot[i];
+    if (slotBytes(slot) == 0)
+    {
+      continue;
+    }
+    if ((slotRefs[slot.offset]++ == 0) && dedupEnabled)
+    {
+      uint8_t data[BLOCK_SIZE];
+      readSlot(slot, data, i);
+      uint32_t contentCrc = crc32c(data, BLOCK_SIZE);
+      contentIndex[contentCrc] = slot;
+      slotContent[slot.offset] = contentCrc;
+    }
+  }
+}
+
+bool loadSlotMap(void)
+{
+  /* Reads slot map of the mounted disk. Returns false if the disk is not
+     compressed. Every byte of an uncompressed image is in some block users
+     can write, and the image is whole blocks. A compressed image ends with
+     SLOT_MAP_MAGIC just after its granule aligned heap, so its size is never
+     whole blocks.
+  */
+  memset(&slotMap, 0, sizeof(Slot_map));
+  slotRefs.clear();
+  contentIndex.clear();
+  slotContent.clear();
+  slotMapDirty = false;
+  struct stat image;
+  char trailer[sizeof(slotMap.magic)];
+  if ( (fstat(fsfd, &image) != 0) || (image.st_size % BLOCK_SIZE == 0) ||
+       (image.st_size < HEAP_OFFSET + (off_t)sizeof(trailer)) ||
+       (diskRead(trailer, sizeof(trailer), image.st_size - sizeof(trailer), -1) != (int)sizeof(trailer)) ||
+       (memcmp(trailer, SLOT_MAP_MAGIC, sizeof(trailer)) != 0) ||
+       (diskRead(&slotMap, sizeof(Slot_map), BLOCK_SIZE, -1) != (int)sizeof(Slot_map)) )
+  {
+    memset(&slotMap, 0, sizeof(Slot_map));
+    return false;
+  }
+  buildSlotIndex();
+  return true;
+}
+
+void writeSlotMap(void)
+{
+  /* Writes slot map of the mounted compressed disk and trims the image file
+     to the end of the slot heap, followed by the SLOT_MAP_MAGIC trailer.
+  */
+  uint8_t tempBuff[BLOCK_SIZE] = {0};
+  memcpy(tempBuff, &slotMap, sizeof(Slot_map));
+  diskWrite(tempBuff, BLOCK_SIZE, BLOCK_SIZE, -1);
+  off_t trailerOffset = HEAP_OFFSET + heapEnd()*SLOT_GRANULE;
+  diskWrite(SLOT_MAP_MAGIC, sizeof(slotMap.magic), trailerOffset, -1);
+
+  // Snapshots keep the end of the heap that trimming drops
+  off_t imageEnd = trailerOffset + sizeof(slotMap.magic);
+  off_t diskSize = lseek(fsfd, 0, SEEK_END);
+  if (!snapshots.empty() && (diskSize > imageEnd))
+  {
+    preservePages(imageEnd, diskSize - imageEnd);
+  }
+  ftruncate(fsfd, imageEnd);
+  slotMapDirty = false;
+}
+
+void compressDisk(void)
+{
+  /* Converts the mounted uncompressed disk into a compressed one: every data
+     block is packed into the slot heap, which replaces the fixed blocks.
+  */
+  vector<uint8_t> data(BLOCK_SIZE*(NUM_BLOCKS-1));
+  diskRead(&data[0], BLOCK_SIZE*(NUM_BLOCKS-1), BLOCK_SIZE, 1);
+
+  info.compressed = true;
+  memset(&slotMap, 0, sizeof(Slot_map));
+  strcpy(slotMap.magic, SLOT_MAP_MAGIC);
+  for (int i = 1; i < NUM_BLOCKS; i++)
+  {
+    storeSlot(i, &data[BLOCK_SIZE*(i-1)]);
+  }
+
+  // Clear old block 2 where the checksum table of a compressed disk lives
+  uint8_t emptyBuff[BLOCK_SIZE] = {0};
+  diskWrite(emptyBuff, BLOCK_SIZE, 2*BLOCK_SIZE, -1);
+  writeSlotMap();
+}
+
+void readBlocks(int blockIdx, void *buff, int count)
+{
+  /* Reads count consecutive blocks starting at blockIdx of the mounted disk
+     into buff with a single read, or from their slots if compressed.
+  */
+  if (info.compressed)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      loadSlot(blockIdx+i, (uint8_t *)buff + BLOCK_SIZE*i);
+    }
+    return;
+  }
+  diskRead(buff, BLOCK_SIZE*count, BLOCK_SIZE*blockIdx, blockIdx);
+}
+
+void writeBlocks(int blockIdx, const void *buff, int count)
+{
+  /* Writes count blocks from buff to consecutive blocks starting at blockIdx
+     of the mounted disk with a single write, or into their slots if compressed.
+  */
+  if (info.compressed)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      storeSlot(blockIdx+i, (const uint8_t *)buff + BLOCK_SIZE*i);
+    }
+  }
+  else
+  {
+    diskWrite(buff, BLOCK_SIZE*count, BLOCK_SIZE*blockIdx, blockIdx);
+    stats.bytesWritten += BLOCK_SIZE*count;
+  }
+
+  if (checksumsEnabled)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      checksums.crc[blockIdx+i] = crc32c((const uint8_t *)buff + BLOCK_SIZE*i, BLOCK_SIZE);
+    }
+    checksumsDirty = true;
+  }
+}
+
+bool blockChecksumOk(int blockIdx, const void *buff)
+{
+  /* Checks buff read from block blockIdx against the checksum table */
+  return (!checksumsEnabled) || (crc32c(buff, BLOCK_SIZE) == checksums.crc[blockIdx]);
+}
+
+void readBlock(int blockIdx, void *buff)
+{
+  /* Reads block with index blockIdx of the mounted disk into buff */
+  readBlocks(blockIdx, buff, 1);
+}
+
+void writeBlock(int blockIdx, const void *buff)
+{
+  /* Writes buff to block with index blockIdx of the mounted disk */
+  writeBlocks(blockIdx, buff, 1);
+}
+
+void writeBlockList(int blockIdx, const uint8_t *const *blocks, int count)
+{
+  /* Writes the count blocks pointed to by blocks to consecutive blocks
+     starting at blockIdx of the mounted disk with a single vectored write,
+     or into their slots if compressed.
+  */
+  if (info.compressed)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      storeSlot(blockIdx+i, blocks[i]);
+    }
+  }
+  else
+  {
+    vector<struct iovec> iov(count);
+    for (int i = 0; i < count; i++)
+    {
+      iov[i].iov_base = (void *)blocks[i];
+      iov[i].iov_len = BLOCK_SIZE;
+    }
+    diskWritev(&iov[0], count, BLOCK_SIZE*blockIdx, blockIdx);
+    stats.bytesWritten += BLOCK_SIZE*count;
+  }
+
+  if (checksumsEnabled)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      checksums.crc[blockIdx+i] = crc32c(blocks[i], BLOCK_SIZE);
+    }
+    checksumsDirty = true;
+  }
+}
+
+void zeroBlocks(int blockIdx, int count)
+{
+  /* Zeroes count consecutive blocks starting at blockIdx */
+  if (count <= 0)
+  {
+    return;
+  }
+  vector<uint8_t> zeros(BLOCK_SIZE*count, 0);
+  writeBlocks(blockIdx, &zeros[0], count);
+}
+
+void moveBlocks(int fromIdx, int toIdx, int count)
+{
+  /* Moves count consecutive blocks from fromIdx to toIdx, like memmove: the
+     ranges may overlap. Source blocks not covered by the destination range
+     are zeroed.
+  */
+  if ((count <= 0) || (fromIdx == toIdx))
+  {
+    return;
+  }
+  vector<uint32_t> crcs(checksums.crc + fromIdx, checksums.crc + fromIdx + count);
+  if (info.compressed)
+  {
+    // Blocks live in slots, so moving them only remaps the slot map. Moved
+    // slots are pinned while remapping so overlapping ranges never drop a
+    // slot's reference count to zero.
+    vector<Slot> slots(slotMap.slot + fromIdx, slotMap.slot + fromIdx + count);
+    for (int i = 0; i < count; i++)
+    {
+      if (slotBytes(slots[i]) > 0)
+      {
+        slotRefs[slots[i].offset]++;
+      }
+    }
+    for (int i = 0; i < count; i++)
+    {
+      setSlot(toIdx+i, slots[i]);
+    }
+    for (int i = 0; i < count; i++)
+    {
+      if (slotBytes(slots[i]) > 0)
+      {
+        slotRefs[slots[i].offset]--;
+      }
+    }
+  }
+  else
+  {
+    vector<uint8_t> data(BLOCK_SIZE*count);
+    tracer.base = fromIdx;
+    readBlocks(fromIdx, &data[0], count);
+    tracer.base = toIdx;
+    writeBlocks(toIdx, &data[0], count);
+  }
+
+  // Carry stored checksums along instead of trusting the data just read, so
+  // corrupt blocks stay detectable after they move
+  copy(crcs.begin(), crcs.end(), checksums.crc + toIdx);
+
+  // Blocks left behind no longer belong to the file
+  tracer.base = -1;
+  if (toIdx < fromIdx)
+  {
+    zeroBlocks(max(fromIdx, toIdx + count), fromIdx + count - max(fromIdx, toIdx + count));
+  }
+  else
+  {
+    zeroBlocks(fromIdx, min(toIdx, fromIdx + count) - fromIdx);
+  }
+}
+
+void copyBlocks(int fromIdx, int toIdx, int count)
+{
+  /* Copies count consecutive blocks from fromIdx to toIdx, which must not
+     overlap them. Compressed blocks share their slots with the copies.
+  */
+  if (count <= 0)
+  {
+    return;
+  }
+  if (info.compressed)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      setSlot(toIdx+i, slotMap.slot[fromIdx+i]);
+    }
+  }
+  else
+  {
+    diskCopy((off_t)BLOCK_SIZE*fromIdx, (off_t)BLOCK_SIZE*toIdx, (off_t)BLOCK_SIZE*count, toIdx);
+    stats.bytesWritten += BLOCK_SIZE*count;
+  }
+
+  // Copies keep the stored checksums, so corrupt blocks stay detectable
+  copy(checksums.crc + fromIdx, checksums.crc + fromIdx + count, checksums.crc + toIdx);
+  if (checksumsEnabled)
+  {
+    checksumsDirty = true;
+  }
+}
+
+void moveFile(int inodeIndex, int newStartBlockIdx)
+{
+  /* Moves the blocks of file of given inode to start at newStartBlockIdx,
+     updating the free block list and its inode
+  */
+  int startBlockIdx = getStartBlock(inodeIndex);
+  int fileSize = getFileSize(inodeIndex);
+
+  // Move mem blocks in one pass, zeroing the blocks left behind
+  moveBlocks(startBlockIdx, newStartBlockIdx, fileSize);
+
+  // Reset old free block list bits, then set new ones (ranges may overlap)
+  for (int j = 0; j < fileSize; j++)
+  {
+    setFreeBlockBit((startBlockIdx+j), 0);
+  }
+  for (int j = 0; j < fileSize; j++)
+  {
+    setFreeBlockBit((newStartBlockIdx+j), 1);
+  }
+  superblock.inode[inodeIndex].start_block = newStartBlockIdx;
+}
+
+int findSlackRun(int neededBlocks, int slack)
+{
+  /* Returns start block for a file of neededBlocks blocks followed by slack
+     free blocks, as high up as possible in the last free run that has room
+     for both, or -1 if none has. Allocations fill the disk from the bottom,
+     so they reach the slack last.
+  */
+  vector<pair<int, int> > runs = getFreeRuns();
+  for (int i = runs.size() - 1; i >= 0; i--)
+  {
+    if (runs[i].second >= neededBlocks + slack)
+    {
+      return runs[i].first + runs[i].second - neededBlocks - slack;
+    }
+  }
+  return -1;
+}
+
+bool isFragmented(void)
+{
+  /* Checks if the free blocks of the mounted disk are split into more than
+     one run, so some free blocks cannot be used by a file as large as the
+     free space
+  */
+  return getFreeRuns().size() > 1;
+}
+
+int defragStep(int budget)
+{
+  /* Moves the file just above the lowest free block down onto it, if it has
+     at most budget blocks. This is one step of fs_defrag.
+     Output: number of blocks moved, 0 if nothing was moved
+  */
+  int firstFreeBlock = 1;
+  while ((firstFreeBlock < NUM_BLOCKS) && getFreeBlockBit(firstFreeBlock))
+  {
+    firstFreeBlock++;
+  }
+
+  int next = -1;
+  for (int i = 0; i < 126; i++)
+  {
+    if ( (superblock.inode[i].used_size & 0x80) && !inodeIsDirectory(i) &&
+         (getStartBlock(i) > firstFreeBlock) && ((next < 0) || (getStartBlock(i) < getStartBlock(next))) )
+    {
+      next = i;
+    }
+  }
+  if ((next < 0) || (getFileSize(next) > budget))
+  {
+    return 0;
+  }
+
+  traceFile(next, getStartBlock(next));
+  moveFile(next, firstFreeBlock);
+  return getFileSize(next);
+}
+
+void permuteBlocks(const vector<int> &from)
+{
+  /* Lays out blocks from block 1 on so that block 1+i holds what block
+     from[i] held, then zeroes the blocks in from that are left outside the
+     new layout. Blocks already in place are not rewritten.
+  */
+  int count = from.size();
+  vector<bool> wasUsed(NUM_BLOCKS, false);
+  vector<uint32_t> crcs(count);
+  for (int i = 0; i < count; i++)
+  {
+    wasUsed[from[i]] = true;
+    crcs[i] = checksums.crc[from[i]];
+  }
+
+  tracer.base = -1;
+  if (info.compressed)
+  {
+    // Only the slot map changes; pin the slots while remapping as moveBlocks does
+    vector<Slot> slots(count);
+    for (int i = 0; i < count; i++)
+    {
+      slots[i] = slotMap.slot[from[i]];
+      if (slotBytes(slots[i]) > 0)
+      {
+        slotRefs[slots[i].offset]++;
+      }
+    }
+    for (int i = 0; i < count; i++)
+    {
+      if (from[i] != 1+i)
+      {
+        setSlot(1+i, slots[i]);
+      }
+    }
+    for (int i = 0; i < count; i++)
+    {
+      if (slotBytes(slots[i]) > 0)
+      {
+        slotRefs[slots[i].offset]--;
+      }
+    }
+  }
+  else
+  {
+    // Read source runs in one go each, then write each run of moved blocks
+    vector<uint8_t> data(BLOCK_SIZE*max(count, 1));
+    for (int i = 0, run; i < count; i += run)
+    {
+      for (run = 1; (i+run < count) && (from[i+run] == from[i] + run); run++);
+      readBlocks(from[i], &data[BLOCK_SIZE*i], run);
+    }
+    for (int i = 0, run; i < count; i += run)
+    {
+      for (run = 1; (i+run < count) && ((from[i+run] != 1+i+run) == (from[i] != 1+i)); run++);
+      if (from[i] != 1+i)
+      {
+        writeBlocks(1+i, &data[BLOCK_SIZE*i], run);
+      }
+    }
+  }
+
+  // Carry stored checksums along, as moveBlocks does
+  copy(crcs.begin(), crcs.end(), checksums.crc + 1);
+  if (checksumsEnabled)
+  {
+    checksumsDirty = true;
+  }
+
+  // Blocks left behind no longer belong to any file
+  for (int i = 1+count, run; i < NUM_BLOCKS; i += run)
+  {
+    for (run = 1; (i+run < NUM_BLOCKS) && (wasUsed[i+run] == wasUsed[i]); run++);
+    if (wasUsed[i])
+    {
+      zeroBlocks(i, run);
+    }
+  }
+}
+
+void heatDefrag(void)
+{
+  /* Packs all files from block 1 on: first files read or written recently,
+     hottest first, then the other files in block order, and last files
+     resized often, next to the free blocks they are likely to grow into
+  */
+  vector<pair<pair<int, int>, int> > order; // ((group, key), inode)
+  for (int i = 0; i < 126; i++)
+  {
+    if ( !(superblock.inode[i].used_size & 0x80) || inodeIsDirectory(i) )
+    {
+      continue;
+    }
+    if (info.resizes[i] >= HOT_RESIZES)
+    {
+      order.push_back(make_pair(make_pair(2, getStartBlock(i)), i));
+    }
+    else if (info.heat[i] > 0)
+    {
+      order.push_back(make_pair(make_pair(0, -(int)info.heat[i]), i));
+    }
+    else
+    {
+      order.push_back(make_pair(make_pair(1, getStartBlock(i)), i));
+    }
+  }
+  sort(order.begin(), order.end());
+
+  vector<int> from;
+  vector<int> newStart(order.size());
+  for (int f = 0; f < (int)order.size(); f++)
+  {
+    int inodeIndex = order[f].second;
+    newStart[f] = 1 + from.size();
+    for (int j = 0; j < getFileSize(inodeIndex); j++)
+    {
+      from.push_back(getStartBlock(inodeIndex) + j);
+    }
+  }
+  permuteBlocks(from);
+
+  for (int f = 0; f < (int)order.size(); f++)
+  {
+    superblock.inode[order[f].second].start_block = newStart[f];
+  }
+  for (int j = 1; j < NUM_BLOCKS; j++)
+  {
+    setFreeBlockBit(j, j <= (int)from.size());
+  }
+}
+
+void writeSuperblock(void)
+{
+  /* Writes superblock of the mounted disk back to block 0 */
+  diskWrite(&superblock, BLOCK_SIZE, 0, -1);
+  syncState.syncedSuper = superblock;
+  stats.superblockWrites++;
+}
+
+off_t checksumsOffset(void)
+{
+  /* Returns location of the checksum table: block 2 of a compressed image,
+     otherwise the block following the last disk block.
+  */
+  return info.compressed ? 2*BLOCK_SIZE : BLOCK_SIZE*NUM_BLOCKS;
+}
+
+void loadChecksums(void)
+{
+  /* Reads checksum table of the mounted disk. If the disk has none yet, the
+     table is built from the current block contents.
+  */
+  memset(&checksums, 0, sizeof(Checksum_block));
+  int bytesRead = diskRead(&checksums, sizeof(Checksum_block), checksumsOffset(), -1);
+
+  if ( (bytesRead != (int)sizeof(Checksum_block)) || (strcmp(checksums.magic, CHECKSUM_MAGIC) != 0) )
+  {
+    vector<uint8_t> data(BLOCK_SIZE*(NUM_BLOCKS-1));
+    readBlocks(1, &data[0], NUM_BLOCKS-1);
+    memset(&checksums, 0, sizeof(Checksum_block));
+    strcpy(checksums.magic, CHECKSUM_MAGIC);
+    for (int i = 1; i < NUM_BLOCKS; i++)
+    {
+      checksums.crc[i] = crc32c(&data[BLOCK_SIZE*(i-1)], BLOCK_SIZE);
+    }
+    checksumsDirty = true;
+  }
+  else
+  {
+    checksumsDirty = false;
+  }
+}
+
+void dropChecksums(void)
+{
+  /* Clears the magic of the checksum table of the mounted disk, if it has
+     one, when mounted without -c. The table is not kept up to date then, so
+     a later run with -c rebuilds it instead of trusting it.
+  */
+  char magic[sizeof(checksums.magic)] = {0};
+  diskRead(magic, sizeof(magic), checksumsOffset(), -1);
+  if (strncmp(magic, CHECKSUM_MAGIC, sizeof(magic)) == 0)
+  {
+    memset(magic, 0, sizeof(magic));
+    diskWrite(magic, sizeof(magic), checksumsOffset(), -1);
+  }
+}
+
+void writeChecksums(void)
+{
+  /* Writes checksum table of the mounted disk */
+  uint8_t tempBuff[BLOCK_SIZE] = {0};
+  memcpy(tempBuff, &checksums, sizeof(Checksum_block));
+  diskWrite(tempBuff, BLOCK_SIZE, checksumsOffset(), -1);
+  checksumsDirty = false;
+}
+
+void syncDisk(void)
+{
+  /* Persists all changes made to the mounted disk since the last sync. The
+     superblock is only rewritten if it changed, and data blocks and superblock
+     share a single fdatasync since they live in the same file.
+  */
+  if (memcmp(&superblock, &syncState.syncedSuper, sizeof(Super_block)) != 0)
+  {
+    writeSuperblock();
+  }
+  if (checksumsDirty)
+  {
+    writeChecksums();
+  }
+  if (slotMapDirty)
+  {
+    writeSlotMap();
+  }
+  if (syncState.dataDirty)
+  {
+    fdatasync(fsfd);
+    syncState.dataDirty = false;
+    stats.syncs++;
+  }
+  syncState.commandsSinceSync = 0;
+  clock_gettime(CLOCK_MONOTONIC, &syncState.lastSync);
+}
+
+string snapshotPath(const char *name)
+{
+  /* Returns file holding snapshot name of the mounted disk */
+  return info.diskName + "@" + name;
+}
+
+void closeSnapshots(void)
+{
+  /* Stops saving changes to the overlay snapshots of the mounted disk */
+  for (int i = 0; i < (int)snapshots.size(); i++)
+  {
+    close(snapshots[i].fd);
+  }
+  snapshots.clear();
+}
+
+bool openSnapshot(const string &path, int fd)
+{
+  /* Starts saving changes to the overlay snapshot in file fd if it is one,
+     reading which pages it already has.
+     Output: false if the file is not an overlay snapshot
+  */
+  Snapshot_header header;
+  if ( (pread(fd, &header, sizeof(Snapshot_header), 0) != (int)sizeof(Snapshot_header)) ||
+       (strncmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) )
+  {
+    return false;
+  }
+
+  Snapshot snap;
+  snap.path = path;
+  snap.fd = fd;
+  snap.imageSize = header.imageSize;
+  uint32_t page;
+  off_t end = lseek(fd, 0, SEEK_END);
+  for (off_t pos = sizeof(Snapshot_header); pos + (off_t)sizeof(uint32_t) + BLOCK_SIZE <= end; pos += sizeof(uint32_t) + BLOCK_SIZE)
+  {
+    pread(fd, &page, sizeof(uint32_t), pos);
+    if (page >= snap.saved.size())
+    {
+      snap.saved.resize(page + 1, false);
+    }
+    snap.saved[page] = true;
+  }
+  snapshots.push_back(snap);
+  return true;
+}
+
+void loadSnapshots(void)
+{
+  /* Finds the overlay snapshots of the mounted disk, the files next to it
+     named <disk>@<snapshot>, so changes keep being saved to them
+  */
+  size_t slash = info.diskName.rfind('/');
+  string dirName = (slash == string::npos) ? "." : info.diskName.substr(0, slash + 1);
+  string prefix = ((slash == string::npos) ? info.diskName : info.diskName.substr(slash + 1)) + "@";
+
+  DIR *dir = opendir(dirName.c_str());
+  if (dir == NULL)
+  {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    if (strncmp(entry->d_name, prefix.c_str(), prefix.size()) != 0)
+    {
+      continue;
+    }
+    string path = snapshotPath(entry->d_name + prefix.size());
+    int fd = open(path.c_str(), O_RDWR);
+    if ((fd >= 0) && !openSnapshot(path, fd))
+    {
+      close(fd); // full image snapshot, nothing to keep up to date
+    }
+  }
+  closedir(dir);
+}
+
+bool copyImage(int fromFd, int toFd)
+{
+  /* Makes file toFd a copy of file fromFd, sharing its extents with a
+     reflink where the file system supports it and copying it otherwise.
+     Output: false if the copy failed
+  */
+  if (ioctl(toFd, FICLONE, fromFd) == 0)
+  {
+    return true;
+  }
+
+  off_t size = lseek(fromFd, 0, SEEK_END);
+  if (ftruncate(toFd, 0) != 0)
+  {
+    return false;
+  }
+  return copyRange(fromFd, 0, toFd, 0, size);
+}
+
+void *flushDisks(void *unused)
+{
+  /* Flusher thread. Writes back, syncs and closes unmounted disks in the
+     order they were unmounted, until stopped with no jobs left.
+  */
+  pthread_mutex_lock(&flushLock);
+  while (true)
+  {
+    while (flushJobs.empty() && !flushStop)
+    {
+      pthread_cond_wait(&flushCond, &flushLock);
+    }
+    if (flushJobs.empty())
+    {
+      break;
+    }
+    Flush_job *job = flushJobs.front();
+    pthread_mutex_unlock(&flushLock);
+
+    for (int i = 0; i < (int)job->writes.size(); i++)
+    {
+      pwrite(job->fd, &job->writes[i].second[0], job->writes[i].second.size(), job->writes[i].first);
+    }
+    if (job->sync)
+    {
+      fdatasync(job->fd);
+      __atomic_add_fetch(&stats.syncs, 1, __ATOMIC_RELAXED);
+    }
+    close(job->fd);
+
+    // Job stays queued until written, so waitForFlush sees it
+    pthread_mutex_lock(&flushLock);
+    flushJobs.pop_front();
+    delete job;
+    pthread_cond_broadcast(&flushCond);
+  }
+  pthread_mutex_unlock(&flushLock);
+  return NULL;
+}
+
+void waitForFlush(const struct stat *disk)
+{
+  /* Waits until the disk file disk has been written back by the flusher
+     thread, or every unmounted disk if disk is NULL
+  */
+  pthread_mutex_lock(&flushLock);
+  while (true)
+  {
+    bool pending = false;
+    for (int i = 0; i < (int)flushJobs.size(); i++)
+    {
+      if ((disk == NULL) || ((flushJobs[i]->dev == disk->st_dev) && (flushJobs[i]->ino == disk->st_ino)))
+      {
+        pending = true;
+      }
+    }
+    if (!pending)
+    {
+      break;
+    }
+    pthread_cond_wait(&flushCond, &flushLock);
+  }
+  pthread_mutex_unlock(&flushLock);
+}
+
+void stopFlusher(void)
+{
+  /* Writes back all unmounted disks and ends the flusher thread */
+  pthread_mutex_lock(&flushLock);
+  bool running = flusherRunning;
+  flushStop = true;
+  pthread_cond_broadcast(&flushCond);
+  pthread_mutex_unlock(&flushLock);
+  if (running)
+  {
+    pthread_join(flusher, NULL);
+  }
+  flusherRunning = false;
+  flushStop = false;
+}
+
+void unmountDisk(void)
+{
+  /* Saves superblock of the mounted disk and closes it, syncing first unless
+     durability mode is none. The writes, sync and close are left to the
+     flusher thread, so the next disk can be used without waiting for them.
+  */
+  struct stat diskStat;
+  fstat(fsfd, &diskStat);
+  Flush_job *job = new Flush_job;
+  job->fd = dup(fsfd);
+  job->dev = diskStat.st_dev;
+  job->ino = diskStat.st_ino;
+  job->sync = (syncState.mode != DURABILITY_NONE);
+
+  // Collect the metadata writes instead of making them
+  flushCapture = job;
+  writeSuperblock();
+  if (checksumsDirty)
+  {
+    writeChecksums();
+  }
+  if (slotMapDirty)
+  {
+    writeSlotMap();
+  }
+  flushCapture = NULL;
+  syncState.dataDirty = false;
+
+  close(fsfd);
+  fsMounted = false;
+  closeSnapshots();
+
+  pthread_mutex_lock(&flushLock);
+  if (!flusherRunning)
+  {
+    pthread_create(&flusher, NULL, flushDisks, NULL);
+    flusherRunning = true;
+  }
+  flushJobs.push_back(job);
+  pthread_cond_broadcast(&flushCond);
+  pthread_mutex_unlock(&flushLock);
+}
+
+void commandDone(void)
+{
+  /* Called after every command; syncs the mounted disk when the durability
+     mode requires it.
+  */
+  if (!fsMounted)
+  {
+    return;
+  }
+
+  if (syncState.mode == DURABILITY_COMMAND)
+  {
+    syncDisk();
+  }
+  else if (syncState.mode == DURABILITY_GROUP)
+  {
+    syncState.commandsSinceSync++;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ( ((syncState.groupCommands > 0) && (syncState.commandsSinceSync >= syncState.groupCommands)) ||
+         ((syncState.groupMillis > 0) && (elapsedMillis(syncState.lastSync, now) >= syncState.groupMillis)) )
+    {
+      syncDisk();
+    }
+  }
+}
+
+void printStats(void)
+{
+  /* Prints throughput and latency statistics of the commands run to stderr */
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double totalMillis = elapsedMillis(stats.start, now);
+  int numCommands = stats.latencies.size();
+
+  vector<double> sorted = stats.latencies;
+  sort(sorted.begin(), sorted.end());
+  double mean = 0;
+  for (int i = 0; i < numCommands; i++)
+  {
+    mean += sorted[i];
+  }
+  if (numCommands > 0)
+  {
+    mean /= numCommands;
+  }
+
+  outPrintf(stderr, "Stats: %d commands in %.3f ms (%.0f commands/s)\n", numCommands, totalMillis,
+            (totalMillis > 0) ? numCommands * 1000.0 / totalMillis : 0.0);
+  outPrintf(stderr, "Stats: %d syncs, %d superblock writes, %lld data bytes written, %d dedup hits\n",
+            stats.syncs, stats.superblockWrites, stats.bytesWritten, stats.dedupHits);
+  outPrintf(stderr, "Stats: dentry cache %d hits, %d misses\n", stats.dentryHits, stats.dentryMisses);
+  outPrintf(stderr, "Stats: %d blocks moved by idle defragmentation, %d files relocated to grow\n",
+            stats.idleDefragBlocks, stats.relocations);
+  if (optimize)
+  {
+    outPrintf(stderr, "Stats: %d commands reduced to their checks by the peephole pass\n", stats.checkOnlyCommands);
+  }
+  if (numCommands > 0)
+  {
+    outPrintf(stderr, "Stats: latency us mean %.1f p50 %.1f p99 %.1f max %.1f\n", mean,
+              sorted[numCommands/2], sorted[(numCommands*99)/100], sorted[numCommands-1]);
+  }
+}
+
+class cmpStartBlock
+{
+  /*
+    Comparator class for sorting a priority queue by start_block
+    with smallest start_block first in the queue.
+  */
+  public:
+    bool operator()(int a, int b)
+    {
+      return (superblock.inode[a].start_block > superblock.inode[b].start_block);
+    }
+};
+
+/* Required Functions ------------------------------------------------------- */
+void fs_mount(char *new_disk_name)
+{
+  /* fs_mount performs 6 consistency checks on the disk file provided.
+     Mounts the disk if all checks pass.
+     Input: new_disk_name - name of the disk file being mounted
+     Output: None
+  */
+  // Check for file existence in current directory
+  int fd = open(new_disk_name, O_RDWR);
+
+  if (fd < 0)
+  {
+    outPrintf(stderr, "Error: Cannot find disk %s\n", new_disk_name);
+    return;
+  }
+
+  // Read the disk only once any write back of it is done. Remounting the
+  // mounted disk first unmounts it, so its latest state is read back.
+  struct stat diskStat, mountedStat;
+  fstat(fd, &diskStat);
+  if ( fsMounted && (fstat(fsfd, &mountedStat) == 0) &&
+       (mountedStat.st_dev == diskStat.st_dev) && (mountedStat.st_ino == diskStat.st_ino) )
+  {
+    unmountDisk();
+  }
+  waitForFlush(&diskStat);
+
+  // Consistency checks
+  bool consistent = true;
+  Super_block tempSuperblock;
+  Disk tempInfo;
+  int inconsistency = 0;
+  memset(tempInfo.childCount, 0, sizeof(tempInfo.childCount));
+  memset(tempInfo.heat, 0, sizeof(tempInfo.heat));
+  memset(tempInfo.resizes, 0, sizeof(tempInfo.resizes));
+  tempInfo.compressed = false; // found once mounted, see loadSlotMap
+  tempInfo.heatClock = 0;
+
+  read(fd, &(tempSuperblock), BLOCK_SIZE);
+
+  /* CONSISTENCY CHECK 1 ---------------------------------------------------- */
+  int freeByteCounter = 0;
+  bitset<8> curByte;
+  while (freeByteCounter < 128)
+  {
+    int modCount = freeByteCounter % 8;
+    if (modCount == 0)
+    {
+      curByte = bitset<8>((unsigned char)tempSuperblock.free_block_list[freeByteCounter/8]);
+    }
+
+    int bitIdx = 7 - modCount;
+
+    // Superblock must not be free in free_block_list
+    if (freeByteCounter == 0)
+    {
+      if (curByte[bitIdx])
+      {
+        freeByteCounter++;
+        continue;
+      } else
+      {
+        consistent = false;
+        inconsistency = 1;
+        break;
+      }
+    }
+
+    // If not looking at superblock bit
+    bool properAlloc = false;
+
+    // get index range using size and start index indicated in inodes
+    for (int i = 0; i < (int)(sizeof(tempSuperblock.inode)/sizeof(Inode)); i++)
+    {
+      int tempUsedSize, lowerLim, upperLim;
+      tempUsedSize = bitset<8>(tempSuperblock.inode[i].used_size & 0x7F).to_ulong();
+      lowerLim = tempSuperblock.inode[i].start_block;
+      if (tempUsedSize > 0)
+      {
+        upperLim = lowerLim + tempUsedSize - 1;
+      } else // could be a directory
+      {
+        upperLim = 0;
+        if (bitset<8>(tempSuperblock.inode[i].dir_parent)[7]) // directory
+        {
+          continue; // skip it as we're checking if marked blocks belong to files
+        }
+      }
+
+      if (curByte[bitIdx]) // block is in use
+      {
+        if ((freeByteCounter >= lowerLim) && (freeByteCounter <= upperLim))
+        {
+          if (!properAlloc)
+          {
+            properAlloc = true;
+          }
+          else // block is used by more than one file
+          {
+            properAlloc = false;
+            break;
+          }
+        }
+      }
+      else // if block is supposed to be free
+      {
+        if ((freeByteCounter >= lowerLim) && (freeByteCounter <= upperLim))
+        {
+          properAlloc = false;
+          break;
+        }
+        else
+        {
+          properAlloc = true;
+        }
+      }
+    }
+
+    if (!properAlloc)
+    {
+      consistent = false;
+      inconsistency = 1;
+      break;
+    }
+
+    freeByteCounter++;
+  }
+
+  if (!consistent)
+  {
+    outPrintf(stderr, "Error: File system in %s is inconsistent (error code: %d)\n", new_disk_name, inconsistency);
+    close(fd);
+    return;
+  }
+
+  /* CONSISTENCY CHECK 2 ---------------------------------------------------- */
+  // For each dir, check if name already in vector before adding to vector
+  for (int i = 0; i < (int)(sizeof(tempSuperblock.inode)/sizeof(Inode)); i++)
+  {
+    // Check if inode is marked "in use"
+    bitset<8> tempBitset = bitset<8>((int)tempSuperblock.inode[i].used_size);
+    if (tempBitset[7] == 0)
+    {
+      continue;
+    }
+
+    // Use a multimap Map<directory number, vector <string>>
+    uint8_t tempDir = tempSuperblock.inode[i].dir_parent & 0x7F;
+    // printf("Using inode %d\n", i);
+    char tempName[6] = {tempSuperblock.inode[i].name[0], tempSuperblock.inode[i].name[1], tempSuperblock.inode[i].name[2], tempSuperblock.inode[i].name[3], tempSuperblock.inode[i].name[4], '\0'};
+    string strName = string(tempName);
+
+    // Check and add if name not in parent directory yet
+    if (tempInfo.directories[tempDir].count(strName) > 0)
+    {
+      consistent = false;
+      inconsistency = 2;
+      break;
+    }
+    else
+    {
+      tempInfo.directories[tempDir][strName] = i;
+      tempInfo.dirChildInodes[tempDir].insert(i);
+      tempInfo.nameIndex[strName].insert(i);
+      tempInfo.childCount[tempDir]++;
+    }
+  }
+  if (!consistent)
+  {
+    outPrintf(stderr, "Error: File system in %s is inconsistent (error code: %d)\n", new_disk_name, inconsistency);
+    close(fd);
+    return;
+  }
+
+  /* CONSISTENCY CHECK 3 ----------------------------------------------------- */
+  vector<int> availableInodes;
+	vector<int> unavailableInodes;
+  for (int i = 0; i < (int)(sizeof(tempSuperblock.inode)/sizeof(Inode)); i++)
+  {
+    // Check if inode is marked "in use"
+    bitset<8> tempBitset = bitset<8>(tempSuperblock.inode[i].used_size);
+    if (tempBitset[7] == 0)
+    {
+      // Make sure all members of inode struct are 0
+      if ((tempSuperblock.inode[i].name[0] != 0) ||
+          (tempSuperblock.inode[i].name[1] != 0) ||
+          (tempSuperblock.inode[i].name[2] != 0) ||
+          (tempSuperblock.inode[i].name[3] != 0) ||
+          (tempSuperblock.inode[i].name[4] != 0) ||
+          (tempSuperblock.inode[i].used_size != 0) ||
+          (tempSuperblock.inode[i].start_block != 0) ||
+          (tempSuperblock.inode[i].dir_parent != 0)
+          )
+      {
+          consistent = false;
+          inconsistency = 3;
+          break;
+      }
+
+      // Add to free inodes list
+      tempInfo.freeInodeIndexes.push_back(i);
+    }
+    else
+    {
+      if ((tempSuperblock.inode[i].name[0] == 0) &&
+          (tempSuperblock.inode[i].name[1] == 0) &&
+          (tempSuperblock.inode[i].name[2] == 0) &&
+          (tempSuperblock.inode[i].name[3] == 0) &&
+          (tempSuperblock.inode[i].name[4] == 0)
+          )
+      {
+          consistent = false;
+          inconsistency = 3;
+          break;
+      }
+			unavailableInodes.push_back(i);
+    }
+  }
+  if (!consistent)
+  {
+    outPrintf(stderr, "Error: File system in %s is inconsistent (error code: %d)\n", new_disk_name, inconsistency);
+    close(fd);
+    return;
+  }
+
+  /* CONSISTENCY CHECKS 4, 5, and 6 ----------------------------------------- */
+	for (int i = 0; i < (int)(unavailableInodes.size()); i++)
+	{
+		// Check only for inodes marked "in use"
+		uint8_t tempDirParent = tempSuperblock.inode[unavailableInodes[i]].dir_parent;
+		bitset<8> tempBitset = bitset<8>(tempDirParent);
+		if (!tempBitset[7]) // is file, start_block must be between 1 and 127
+		{
+			if ((tempSuperblock.inode[unavailableInodes[i]].start_block < 1) ||
+					(tempSuperblock.inode[unavailableInodes[i]].start_block > 127))
+			{
+				consistent = false;
+				inconsistency = 4;
+				break;
+			}
+		}
+		else // is dir, size and start_block must both be 0
+		{
+			if ( ((tempSuperblock.inode[unavailableInodes[i]].used_size & 0x7F) != 0) ||
+					 (tempSuperblock.inode[unavailableInodes[i]].start_block != 0))
+			{
+				consistent = false;
+				inconsistency = 5;
+			}
+		}
+
+		int tempParentNodeIdx = (int) (tempDirParent & 0x7F);
+		if ( (tempParentNodeIdx != 127) && ( (tempParentNodeIdx < 0) || (tempParentNodeIdx > 125) ) )
+		{
+			// Not valid parent inode index
+		  consistent = false;
+		  if (inconsistency == 0)
+		  {
+		    inconsistency = 6;
+		  }
+		}
+		else if ( (tempParentNodeIdx != 127) && ( (tempParentNodeIdx >= 0) || (tempParentNodeIdx <= 125) ) )
+		{
+			// Check if parent inode is in use and marked as directory
+		  bitset<8> tempParentDirParent = bitset<8>((int)tempSuperblock.inode[tempParentNodeIdx].dir_parent);
+		  bitset<8> tempParentUsedSize = bitset<8>((int)tempSuperblock.inode[tempParentNodeIdx].used_size);
+
+		  if ( (!tempParentDirParent[7]) || (!tempParentUsedSize[7]) )
+		  {
+		    consistent = false;
+        if (inconsistency == 0)
+        {
+          inconsistency = 6;
+        }
+		  }
+		}
+	}
+
+	if (!consistent)
+	{
+		outPrintf(stderr, "Error: File system in %s is inconsistent (error code: %d)\n", new_disk_name, inconsistency);
+		close(fd);
+		return;
+	}
+
+  // Mount that sucker
+  if (fsMounted)
+  {
+    unmountDisk();
+  }
+  if (tracer.fd >= 0)
+  {
+    traceDisk(new_disk_name, &diskStat);
+  }
+
+  superblock = tempSuperblock;
+	lseek(fd, 0, SEEK_SET); // return fp to point to beginning of file because why not?
+  fsfd = fd; // old descriptor may still be written back by the flusher thread
+  fsMounted = true;
+  tempInfo.currWorkDir = 127; // set working directory to root
+  tempInfo.diskName = string(new_disk_name);
+  info = tempInfo;
+  dentryCache.clear();
+  rebuildUsage();
+  loadSnapshots();
+
+  nextFitBlock = 1;
+  info.compressed = loadSlotMap();
+  if (checksumsEnabled)
+  {
+    loadChecksums();
+  }
+  else
+  {
+    dropChecksums();
+  }
+  if (!info.compressed && (compressOnMount || dedupEnabled))
+  {
+    compressDisk();
+    checksumsDirty = checksumsEnabled; // table moves to its compressed location
+  }
+  syncState.syncedSuper = superblock;
+  syncState.dataDirty = false;
+  syncState.commandsSinceSync = 0;
+  clock_gettime(CLOCK_MONOTONIC, &syncState.lastSync);
+}
+
+void fs_create(char name[5], int size)
+{
+  /* fs_create creates a file of a given size. If the given size is 0, it
+     creates a directory. When creating a file, we use the first available
+     inode to store the attributes.
+     Input: name - name of the directory or file being mounted
+            size - size of the file. If 0, creating a directory.
+     Output: None
+  */
+  createElided = false;
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  int neededBlocks = size;
+
+  if (info.freeInodeIndexes.empty())
+  {
+    outPrintf(stderr, "Error: Superblock in disk %s is full, cannot create %s\n", info.diskName.c_str(), name);
+    return;
+  }
+
+  char tempName[6] = {name[0], name[1], name[2], name[3], name[4], '\0'};
+
+  if ( (getChildInode(name) >= 0) ||
+       (strcmp(name, ".") == 0) || (strcmp(name, "..") == 0) )
+  {
+    // Not unique name in this directory
+    outPrintf(stderr, "Error: File or directory %s already exists\n", name);
+    return;
+  }
+
+  if (size == 0) // creating a directory
+  {
+    // Its D follows with nothing between that could see it
+    if (checkOnly)
+    {
+      createElided = true;
+      return;
+    }
+
+    // Store attributes into first available inode
+    addInode(info.currWorkDir, tempName, 0, 0);
+  }
+  else if ((size < 0) || (size > 127)) // impossible to store files of size outside [1,127] blocks
+  {
+    outPrintf(stderr, "Error: Cannot allocate %d on %s\n", size, info.diskName.c_str());
+    return;
+  }
+  else // creating a file. find set of continuous free blocks that can store file
+  {
+    // Pick N consecutive free blocks using the allocation policy
+    int startBlockIdx = findFreeRun(neededBlocks);
+    if ((startBlockIdx >= 0) && checkOnly)
+    {
+      // Its D follows with nothing between that could see it, so only
+      // write the zeroes D would
+      zeroBlocks(startBlockIdx, neededBlocks);
+      createElided = true;
+    }
+    else if (startBlockIdx >= 0)
+    {
+      // Store attributes into first available inode
+      addInode(info.currWorkDir, tempName, size, startBlockIdx);
+
+      // Update superblock's free block list
+      for (int j = startBlockIdx; j < (startBlockIdx + neededBlocks); j++)
+      {
+        setFreeBlockBit(j, 1);
+      }
+    }
+    else
+    {
+      outPrintf(stderr, "Error: Cannot allocate %d on %s\n", size, info.diskName.c_str());
+      return;
+    }
+  }
+}
+
+void fs_delete(char name[5])
+{
+  /* fs_delete checks for and delete file/directory of name in the current
+     working directory.
+     Input: name - name of the directory or file being deleted
+     Output: None
+  */
+  // The C just before only checked it could create the item
+  if (checkOnly && createElided)
+  {
+    return;
+  }
+
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  int inodeIndex = getChildInode(name);
+  char tempName[6] = {name[0], name[1], name[2], name[3], name[4], 0};
+
+  // Check if specified file or directory is in current working directory
+  if ( inodeIndex < 0 )
+  {
+    outPrintf(stderr, "Error: File or directory %s does not exist\n", tempName);
+    return;
+  }
+
+  // File or dir exists! Time to delete
+
+  if (!inodeIsDirectory(inodeIndex))
+  {
+    // Is a file. Need to zero out used mem blocks and update free block list
+    int startBlockIdx = getStartBlock(inodeIndex);
+    int fileSize = getFileSize(inodeIndex);
+    traceFile(inodeIndex, startBlockIdx);
+
+    char tempBuff[BLOCK_SIZE];
+    memset(tempBuff, 0, BLOCK_SIZE);
+
+    for (int i = 0; i < fileSize; i++)
+    {
+      writeBlock(startBlockIdx+i, tempBuff);
+      setFreeBlockBit((startBlockIdx+i), 0);
+    }
+  }
+  else // is a directory, need to recursively delete
+  {
+    // Update current work directory
+    int tempCurrWorkDir = info.currWorkDir;
+    info.currWorkDir = inodeIndex;
+
+    // Delete items of directory with fs_delete until none are left
+    map<string, int> &names = info.directories[info.currWorkDir];
+    while (!names.empty())
+    {
+      char tempName[6] = {0};
+      strncpy(tempName, names.begin()->first.c_str(), 5);
+      fs_delete(tempName);
+    }
+
+    // Restore current work directory
+    info.currWorkDir = tempCurrWorkDir;
+  }
+
+  // Children are gone by now, so only the item itself leaves the totals
+  bool isDir = inodeIsDirectory(inodeIndex);
+  addUsage(info.currWorkDir, -!isDir, -isDir, isDir ? 0 : -getFileSize(inodeIndex));
+  memset(&(superblock.inode[inodeIndex]), 0, sizeof(Inode));  // Set inode to 0
+
+  // Update info on directories
+  info.directories[info.currWorkDir].erase(string(tempName));
+  info.dirChildInodes[info.currWorkDir].erase(inodeIndex);
+  set<int> &sameName = info.nameIndex[string(tempName)];
+  sameName.erase(inodeIndex);
+  if (sameName.empty())
+  {
+    info.nameIndex.erase(string(tempName));
+  }
+  info.childCount[info.currWorkDir]--;
+  dentryCache.erase(make_pair(info.currWorkDir, string(tempName)));
+
+  // Update and sort list of free inodes
+  info.freeInodeIndexes.push_back(inodeIndex);
+  sort(info.freeInodeIndexes.begin(), info.freeInodeIndexes.end());
+}
+
+void fs_read(char name[5], int block_num)
+{
+  /* fs_read checks for and reads a KB block from file in the current
+     working directory into the buffer.
+     Input: name - name of the file being read
+            block_num - index of block in file to read
+     Output: None
+  */
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  // Look the file up in the published metadata
+  char tempName[6] = {name[0], name[1], name[2], name[3], name[4], 0};
+  Meta_version *meta = pinMetadata();
+  int inodeIndex = findItem(meta, info.currWorkDir, tempName);
+  Inode inode;
+  if (inodeIndex >= 0)
+  {
+    inode = meta->superblock.inode[inodeIndex];
+  }
+  unpinMetadata();
+
+  if ((inodeIndex < 0) || (inode.dir_parent & 0x80))
+  {
+    outPrintf(stderr, "Error: File %s does not exist\n", tempName);
+    return;
+  }
+
+  int fileSize = inode.used_size & 0x7F;
+
+  if ( (block_num < 0) || (block_num > (fileSize - 1)) )
+  {
+    outPrintf(stderr, "Error: %s does not have block %d\n", tempName, block_num);
+    return;
+  }
+
+  // Otherwise, block of file exists. Read it into the buffer
+  int startBlockIdx = inode.start_block;
+  traceFile(inodeIndex, startBlockIdx);
+  touchFile(inodeIndex, info.heat);
+
+  uint8_t tempBuff[BLOCK_SIZE];
+  readBlock(startBlockIdx+block_num, tempBuff);
+
+  if (!blockChecksumOk(startBlockIdx+block_num, tempBuff))
+  {
+    outPrintf(stderr, "Error: Checksum mismatch in block %d of %s\n", block_num, tempName);
+    return;
+  }
+  memcpy(ioBuffer, tempBuff, BLOCK_SIZE);
+}
+
+void fs_write(char name[5], int block_num)
+{
+  /* fs_write writes current contents of buffer into specified block of file.
+     Input: name - name of the file being written to
+            block_num - index of block in file to write to
+     Output: None
+  */
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  int inodeIndex = getChildInode(name);
+  char tempName[6] = {name[0], name[1], name[2], name[3], name[4], 0};
+
+  if (inodeIndex < 0)
+  {
+    outPrintf(stderr, "Error: File %s does not exist\n", tempName);
+    return;
+  }
+
+  if (inodeIsDirectory(inodeIndex))
+  {
+    outPrintf(stderr, "Error: File %s does not exist\n", tempName);
+    return;
+  }
+
+  int fileSize = getFileSize(inodeIndex);
+
+  if ( (block_num < 0) || (block_num > (fileSize - 1)) )
+  {
+    outPrintf(stderr, "Error: %s does not have block %d\n", tempName, block_num);
+    return;
+  }
+
+  // Otherwise, block of file exists. Read it into the buffer
+  int startBlockIdx = getStartBlock(inodeIndex);
+  traceFile(inodeIndex, startBlockIdx);
+  touchFile(inodeIndex, info.heat);
+
+  // A block written again before it is read need not be written now,
+  // unless that would change where compressed blocks end up
+  if (checkOnly && !info.compressed)
+  {
+    return;
+  }
+  writeBlock(startBlockIdx+block_num, ioBuffer);
+}
+
+void fillBuffer(const uint8_t *data, int length)
+{
+  /* Writes length bytes of data into the buffer, then flushes only the
+     bytes after them.
+     Input: data - new contents of buffer
+            length - bytes of data, at most BLOCK_SIZE
+     Output: None
+  */
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  if (checkOnly)
+  {
+    return;
+  }
+  memcpy(ioBuffer, data, length);
+  memset(ioBuffer + length, 0, BLOCK_SIZE - length);
+}
+
+void fs_buff(uint8_t buff[BLOCK_SIZE])
+{
+  /* fs_buff flushes and writes new characters into the buffer.
+     Input: buff - character array to replace contents of buffer with, ending
+                   at its first zero byte or after BLOCK_SIZE bytes
+     Output: None
+  */
+  fillBuffer(buff, strnlen((const char *)buff, BLOCK_SIZE));
+}
+
+void fs_batch_write(char *tuples)
+{
+  /* fs_batch_write writes registers into blocks of files, given as
+     "register file block" triples. Blocks are written in disk order, each
+     run of adjacent blocks with a single vectored write. If two triples name
+     the same block, the later one is written.
+     Input: tuples - space separated triples checked by parseCommand
+     Output: None
+  */
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  vector<Batch_write> writes;
+  char *savePtr;
+  for (char *tok = strtok_r(tuples, " ", &savePtr); tok != NULL; tok = strtok_r(NULL, " ", &savePtr))
+  {
+    int reg = atoi(tok);
+    char *path = strtok_r(NULL, " ", &savePtr);
+    int blockNum = atoi(strtok_r(NULL, " ", &savePtr));
+
+    char name[6];
+    int dir = resolvePath(path, name);
+    if (dir < 0)
+    {
+      outPrintf(stderr, "Error: Directory %s does not exist\n", path);
+      continue;
+    }
+    int inodeIndex = lookupChild(dir, name);
+    if ((inodeIndex < 0) || (inodeIndex == 127) || inodeIsDirectory(inodeIndex))
+    {
+      outPrintf(stderr, "Error: File %s does not exist\n", name);
+      continue;
+    }
+    if (blockNum > getFileSize(inodeIndex) - 1)
+    {
+      outPrintf(stderr, "Error: %s does not have block %d\n", name, blockNum);
+      continue;
+    }
+
+    Batch_write write;
+    write.base = getStartBlock(inodeIndex);
+    write.block = write.base + blockNum;
+    write.inode = inodeIndex;
+    write.data = registerBuffer(reg);
+    writes.push_back(write);
+    touchFile(inodeIndex, info.heat);
+  }
+
+  // Sort by disk block, keeping the last write of each block
+  stable_sort(writes.begin(), writes.end(), batchWriteBefore);
+  vector<const uint8_t *> blocks;
+  for (size_t i = 0; i < writes.size(); i++)
+  {
+    if ((i+1 < writes.size()) && (writes[i+1].block == writes[i].block))
+    {
+      continue;
+    }
+    if (blocks.empty())
+    {
+      traceFile(writes[i].inode, writes[i].base);
+    }
+    blocks.push_back(writes[i].data);
+
+    // Write the run once the next block is not adjacent
+    if ((i+1 == writes.size()) || (writes[i+1].block != writes[i].block + 1))
+    {
+      writeBlockList(writes[i].block - (int)blocks.size() + 1, &blocks[0], blocks.size());
+      blocks.clear();
+    }
+  }
+}
+
+void fs_ls(void)
+{
+  /* fs_ls prints out all items in the current working directory. Prints names
+     of files with their sizes and directories with their number of items.
+     Input: None
+     Output: None
+  */
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  // Format the whole listing from the published metadata and output it at
+  // once. Directories list their number of items plus . and ..
+  Meta_version *meta = pinMetadata();
+  char listing[128*16];
+  int length = 0;
+  int parentDir = info.currWorkDir;
+
+  // Print . for current directory and number of items inside
+  length += sprintf(listing + length, "%-5s %3d\n", ".", meta->childCount[info.currWorkDir] + 2);
+
+  // Print .. and number of items inside
+  // If currWorkDir is not root (127), need to find num of items in parent directory
+  if (info.currWorkDir != 127)
+  {
+    parentDir = meta->superblock.inode[info.currWorkDir].dir_parent & 0x7F;
+  }
+  length += sprintf(listing + length, "%-5s %3d\n", "..", meta->childCount[parentDir] + 2);
+
+  // Print name and size for each item in currWorkDir, in inode order
+  for (int child = 0; child < 126; child++)
+  {
+    Inode *inode = &meta->superblock.inode[child];
+    if ( !(inode->used_size & 0x80) || ((inode->dir_parent & 0x7F) != info.currWorkDir) )
+    {
+      continue;
+    }
+
+    char tempName[6] = {inode->name[0], inode->name[1], inode->name[2], inode->name[3], inode->name[4], '\0'};
+    if (inode->dir_parent & 0x80)
+    {
+      length += sprintf(listing + length, "%-5s %3d\n", tempName, meta->childCount[child] + 2);
+    }
+    else
+    {
+      length += sprintf(listing + length, "%-5s %3d KB\n", tempName, inode->used_size & 0x7F);
+    }
+  }
+  unpinMetadata();
+  outWrite(stdout, listing, length);
+}
+
+void fs_du(void)
+{
+  /* fs_du prints the number of files and directories below the current
+     working directory and the blocks its files use, from the usage totals
+     kept up to date by create, delete and resize.
+     Input: None
+     Output: None
+  */
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  Meta_version *meta = pinMetadata();
+  Usage usage = meta->usage[info.currWorkDir];
+  unpinMetadata();
+  outPrintf(stdout, "%d KB in %d files, %d directories\n", usage.blocks, usage.files, usage.dirs);
+}
+
+string itemPath(int inodeIndex)
+{
+  /* Returns the full path of an item, following parent links up to root */
+  string path;
+  for (int i = inodeIndex; i != 127; i = superblock.inode[i].dir_parent & 0x7F)
+  {
+    char tempName[6] = {superblock.inode[i].name[0], superblock.inode[i].name[1], superblock.inode[i].name[2],
+                        superblock.inode[i].name[3], superblock.inode[i].name[4], 0};
+    path = "/" + string(tempName) + path;
+  }
+  return path.empty() ? "/" : path;
+}
+
+void fs_find(char *pattern)
+{
+  /* fs_find prints the full path of every item on the disk called pattern,
+     or whose name starts with pattern if it ends in '*', in path order.
+     Directories are printed with a trailing '/'.
+     Input: pattern - name, or name prefix followed by '*'
+     Output: None
+  */
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  string name = pattern;
+  bool prefix = !name.empty() && (name[name.size()-1] == '*');
+  if (prefix)
+  {
+    name.erase(name.size()-1);
+  }
+
+  // Names sharing the prefix are adjacent in the index
+  vector<string> paths;
+  map<string, set<int> >::iterator entry = info.nameIndex.lower_bound(name);
+  for (; entry != info.nameIndex.end(); entry++)
+  {
+    if (prefix ? (entry->first.compare(0, name.size(), name) != 0) : (entry->first != name))
+    {
+      break;
+    }
+    for (set<int>::iterator item = entry->second.begin(); item != entry->second.end(); item++)
+    {
+      paths.push_back(itemPath(*item) + (inodeIsDirectory(*item) ? "/" : ""));
+    }
+  }
+
+  sort(paths.begin(), paths.end());
+  for (size_t i = 0; i < paths.size(); i++)
+  {
+    outPrintf(stdout, "%s\n", paths[i].c_str());
+  }
+}
+
+void fs_import(char name[5], char *hostPath)
+{
+  /* fs_import creates a file in the current working directory holding the
+     contents of a file on the host, padded with zeroes to whole blocks. The
+     contents are copied straight into the file's blocks by the kernel unless
+     they must be compressed or checksummed on the way.
+     Input: name - name of the file being created
+            hostPath - path of the host file to copy
+     Output: None
+  */
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  struct stat hostStat;
+  int hostFd = open(hostPath, O_RDONLY);
+  if ((hostFd < 0) || (fstat(hostFd, &hostStat) != 0))
+  {
+    outPrintf(stderr, "Error: Cannot open %s\n", hostPath);
+    if (hostFd >= 0)
+    {
+      close(hostFd);
+    }
+    return;
+  }
+
+  off_t bytes = hostStat.st_size;
+  off_t size = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if ((size < 1) || (size > 127))
+  {
+    outPrintf(stderr, "Error: Cannot allocate %lld on %s\n", (long long)size, info.diskName.c_str());
+    close(hostFd);
+    return;
+  }
+
+  // fs_create reports why the file could not be created
+  size_t freeInodes = info.freeInodeIndexes.size();
+  fs_create(name, size);
+  if (info.freeInodeIndexes.size() == freeInodes)
+  {
+    close(hostFd);
+    return;
+  }
+  int inodeIndex = getChildInode(name);
+  int startBlockIdx = getStartBlock(inodeIndex);
+  traceFile(inodeIndex, startBlockIdx);
+
+  bool copied;
+  if (info.compressed || checksumsEnabled)
+  {
+    // Blocks pass through memory to be compressed or checksummed
+    vector<uint8_t> data(BLOCK_SIZE*size, 0);
+    copied = (pread(hostFd, &data[0], bytes, 0) == bytes);
+    if (copied)
+    {
+      writeBlocks(startBlockIdx, &data[0], size);
+    }
+  }
+  else
+  {
+    off_t offset = (off_t)BLOCK_SIZE*startBlockIdx;
+    copied = diskCopyIn(hostFd, bytes, offset, startBlockIdx);
+
+    // Zero the rest of the last block
+    uint8_t zeros[BLOCK_SIZE] = {0};
+    if (copied && (bytes < BLOCK_SIZE*size))
+    {
+      diskWrite(zeros, BLOCK_SIZE*size - bytes, offset + bytes, startBlockIdx + size - 1);
+    }
+    stats.bytesWritten += BLOCK_SIZE*size;
+  }
+  close(hostFd);
+
+  if (!copied)
+  {
+    outPrintf(stderr, "Error: Cannot read %s\n", hostPath);
+
+    // Remove the file again rather than leave it partly filled
+    fs_delete(name);
+  }
+}
+
+void discardHostFile(int hostFd, const char *hostPath)
+{
+  /* Closes and removes a partly written host file. Only a regular file
+     that hostPath itself names is removed, so devices and links such as
+     /dev/stdout are left in place.
+  */
+  struct stat hostStat, pathStat;
+  bool regular = (fstat(hostFd, &hostStat) == 0) && (lstat(hostPath, &pathStat) == 0) &&
+                 S_ISREG(pathStat.st_mode) && (pathStat.st_dev == hostStat.st_dev) &&
+                 (pathStat.st_ino == hostStat.st_ino);
+  close(hostFd);
+  if (regular)
+  {
+    unlink(hostPath);
+  }
+}
+
+void fs_export(char name[5], char *hostPath)
+{
+  /* fs_export copies all blocks of a file in the current working directory
+     to a file on the host, replacing it. The blocks are copied straight from
+     the disk file by the kernel unless they must be decompressed or
+     checksummed on the way.
+     Input: name - name of the file being copied
+            hostPath - path of the host file to write
+     Output: None
+  */
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  int inodeIndex = getChildInode(name);
+  char tempName[6] = {name[0], name[1], name[2], name[3], name[4], 0};
+  if ((inodeIndex < 0) || inodeIsDirectory(inodeIndex))
+  {
+    outPrintf(stderr, "Error: File %s does not exist\n", tempName);
+    return;
+  }
+  int size = getFileSize(inodeIndex);
+  int startBlockIdx = getStartBlock(inodeIndex);
+  traceFile(inodeIndex, startBlockIdx);
+
+  int hostFd = open(hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (hostFd < 0)
+  {
+    outPrintf(stderr, "Error: Cannot open %s\n", hostPath);
+    return;
+  }
+
+  bool copied;
+  if (info.compressed || checksumsEnabled)
+  {
+    // Blocks pass through memory to be decompressed or checksummed
+    vector<uint8_t> data(BLOCK_SIZE*size);
+    readBlocks(startBlockIdx, &data[0], size);
+    for (int i = 0; i < size; i++)
+    {
+      if (!blockChecksumOk(startBlockIdx+i, &data[BLOCK_SIZE*i]))
+      {
+        outPrintf(stderr, "Error: Checksum mismatch in block %d of %s\n", i, tempName);
+        discardHostFile(hostFd, hostPath);
+        return;
+      }
+    }
+    copied = (write(hostFd, &data[0], data.size()) == (ssize_t)data.size());
+  }
+  else
+  {
+    copied = diskCopyOut(hostFd, (off_t)BLOCK_SIZE*size, (off_t)BLOCK_SIZE*startBlockIdx, startBlockIdx);
+  }
+
+  if (!copied)
+  {
+    outPrintf(stderr, "Error: Cannot write %s\n", hostPath);
+    discardHostFile(hostFd, hostPath);
+    return;
+  }
+  close(hostFd);
+}
+
+void fs_copy(char *fromPath, char *toPath)
+{
+  /* fs_copy copies a file, or a directory with everything below it, to a
+     new item. A planning pass over the source subtree first finds inodes
+     and blocks for every copy, in one run of blocks if they fit, laid out in
+     the order of the source blocks. Source files next to each other on disk
+     then stay next to each other, and each run of them is copied with a
+     single copyBlocks.
+     Input: fromPath - path of the file or directory to copy
+            toPath - path of the new item, which must not exist yet
+     Output: None
+  */
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  char fromName[6], toName[6];
+  int fromDir = resolvePath(fromPath, fromName);
+  int from = (fromDir < 0) ? -1 : ((fromName[0] == '\0') ? 127 : lookupChild(fromDir, fromName));
+  if (from < 0)
+  {
+    outPrintf(stderr, "Error: File or directory %s does not exist\n", fromPath);
+    return;
+  }
+  int toDir = resolvePath(toPath, toName);
+  if ((toDir < 0) || ((toDir != 127) && !inodeIsDirectory(toDir)))
+  {
+    outPrintf(stderr, "Error: Directory %s does not exist\n", toPath);
+    return;
+  }
+  if ( (lookupChild(toDir, toName) >= 0) || (strcmp(toName, ".") == 0) || (strcmp(toName, "..") == 0) )
+  {
+    outPrintf(stderr, "Error: File or directory %s already exists\n", toPath);
+    return;
+  }
+  bool fromIsDir = (from == 127) || inodeIsDirectory(from);
+  for (int dir = toDir; fromIsDir; dir = superblock.inode[dir].dir_parent & 0x7F)
+  {
+    if (dir == from)
+    {
+      outPrintf(stderr, "Error: Cannot copy %s into itself\n", fromPath);
+      return;
+    }
+    if (dir == 127)
+    {
+      break;
+    }
+  }
+
+  // Planning pass: list the subtree with parents before children, and the
+  // blocks needed by its files
+  vector<int> items(1, from);
+  vector<int> parents(1, -1);
+  int totalBlocks = fromIsDir ? 0 : getFileSize(from);
+  for (int i = 0; (i < (int)items.size()) && fromIsDir; i++)
+  {
+    if ((items[i] != 127) && !inodeIsDirectory(items[i]))
+    {
+      continue;
+    }
+    set<int> &children = info.dirChildInodes[items[i]];
+    for (set<int>::iterator child = children.begin(); child != children.end(); child++)
+    {
+      items.push_back(*child);
+      parents.push_back(i);
+      totalBlocks += inodeIsDirectory(*child) ? 0 : getFileSize(*child);
+    }
+  }
+  if (info.freeInodeIndexes.size() < items.size())
+  {
+    outPrintf(stderr, "Error: Superblock in disk %s is full, cannot create %s\n", info.diskName.c_str(), toName);
+    return;
+  }
+
+  // Files in order of their source blocks, as (source start, item)
+  vector<pair<int, int> > files;
+  for (int i = 0; i < (int)items.size(); i++)
+  {
+    if ((items[i] != 127) && !inodeIsDirectory(items[i]))
+    {
+      files.push_back(make_pair(getStartBlock(items[i]), i));
+    }
+  }
+  sort(files.begin(), files.end());
+
+  // Place the copies in one run if possible, else each in its own run
+  vector<int> toStart(items.size(), 0);
+  int runStart = (totalBlocks > 0) ? findFreeRun(totalBlocks) : -1;
+  for (int f = 0; f < (int)files.size(); f++)
+  {
+    int item = files[f].second;
+    int size = getFileSize(items[item]);
+    toStart[item] = (runStart >= 0) ? runStart : findFreeRun(size);
+    if (toStart[item] < 0)
+    {
+      // Give back the blocks taken so far
+      for (int g = 0; g < f; g++)
+      {
+        int placed = files[g].second;
+        for (int j = toStart[placed]; j < toStart[placed] + getFileSize(items[placed]); j++)
+        {
+          setFreeBlockBit(j, 0);
+        }
+      }
+      outPrintf(stderr, "Error: Cannot allocate %d on %s\n", size, info.diskName.c_str());
+      return;
+    }
+    for (int j = toStart[item]; j < toStart[item] + size; j++)
+    {
+      setFreeBlockBit(j, 1);
+    }
+    if (runStart >= 0)
+    {
+      runStart += size;
+    }
+  }
+
+  // Copy the data, merging files whose source and copy are both adjacent
+  for (int f = 0; f < (int)files.size(); )
+  {
+    int first = files[f].second;
+    int count = getFileSize(items[first]);
+    for (f++; f < (int)files.size(); f++)
+    {
+      int next = files[f].second;
+      if ( (getStartBlock(items[next]) != getStartBlock(items[first]) + count) ||
+           (toStart[next] != toStart[first] + count) )
+      {
+        break;
+      }
+      count += getFileSize(items[next]);
+    }
+    copyBlocks(getStartBlock(items[first]), toStart[first], count);
+  }
+
+  // Create the copies, parents first
+  vector<int> copies(items.size());
+  for (int i = 0; i < (int)items.size(); i++)
+  {
+    bool isDir = (items[i] == 127) || inodeIsDirectory(items[i]);
+    char tempName[6] = {0};
+    if (i == 0)
+    {
+      strcpy(tempName, toName);
+    }
+    else
+    {
+      // Only the top item can be the root, which has no inode
+      memcpy(tempName, superblock.inode[items[i]].name, 5);
+    }
+    copies[i] = addInode((i == 0) ? toDir : copies[parents[i]], tempName,
+                         isDir ? 0 : getFileSize(items[i]), isDir ? 0 : toStart[i]);
+  }
+}
+
+int openSnapshotFile(const char *name, Snapshot_header *header)
+{
+  /* Opens snapshot name of the mounted disk and reads its header.
+     Output: file descriptor, or -1 after printing an error if there is no
+             such snapshot
+  */
+  string path = snapshotPath(name);
+  int fd = open(path.c_str(), O_RDWR);
+  if (fd < 0)
+  {
+    outPrintf(stderr, "Error: Snapshot %s does not exist\n", name);
+    return -1;
+  }
+  memset(header, 0, sizeof(Snapshot_header));
+  pread(fd, header, sizeof(Snapshot_header), 0);
+  return fd;
+}
+
+bool isOverlay(Snapshot_header *header)
+{
+  /* Checks if a snapshot file header is that of an overlay snapshot */
+  return strncmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0;
+}
+
+void fs_snapshot(char *name)
+{
+  /* fs_snapshot freezes the current state of the mounted disk as snapshot
+     name, in the file <disk>@<name>. Where the file system supports
+     reflinks the snapshot is a copy of the disk file sharing its extents.
+     Otherwise it is an overlay: an empty file that the old contents of
+     every page of the disk file are saved to before the page first changes.
+     Either way only metadata is written when the snapshot is taken.
+     Input: name - name of the snapshot, replaced if it exists
+     Output: None
+  */
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  // The disk file must hold everything done so far
+  syncDisk();
+
+  string path = snapshotPath(name);
+  for (int i = 0; i < (int)snapshots.size(); i++)
+  {
+    if (snapshots[i].path == path)
+    {
+      close(snapshots[i].fd);
+      snapshots.erase(snapshots.begin() + i);
+      break;
+    }
+  }
+
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    outPrintf(stderr, "Error: Cannot create snapshot %s\n", name);
+    return;
+  }
+  if (ioctl(fd, FICLONE, fsfd) == 0)
+  {
+    close(fd);
+    return;
+  }
+
+  Snapshot_header header;
+  memset(&header, 0, sizeof(Snapshot_header));
+  strncpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.imageSize = lseek(fsfd, 0, SEEK_END);
+  if (write(fd, &header, sizeof(Snapshot_header)) != (int)sizeof(Snapshot_header))
+  {
+    outPrintf(stderr, "Error: Cannot create snapshot %s\n", name);
+    close(fd);
+    return;
+  }
+  openSnapshot(path, fd);
+}
+
+void fs_clone(char *name, char *new_disk_name)
+{
+  /* fs_clone creates a new disk file holding the state of the mounted disk
+     in snapshot name. Reflinked snapshots are cloned without copying data;
+     overlay snapshots clone the disk file and put back the pages saved in
+     the snapshot.
+     Input: name - name of the snapshot
+            new_disk_name - disk file to create, replaced if it exists
+     Output: None
+  */
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+  if (info.diskName == new_disk_name)
+  {
+    outPrintf(stderr, "Error: Disk %s is mounted\n", new_disk_name);
+    return;
+  }
+
+  Snapshot_header header;
+  int snapFd = openSnapshotFile(name, &header);
+  if (snapFd < 0)
+  {
+    return;
+  }
+  // The disk replaced may still be waiting to be written back
+  waitForFlush(NULL);
+  int newFd = open(new_disk_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (newFd < 0)
+  {
+    outPrintf(stderr, "Error: Cannot create disk %s\n", new_disk_name);
+    close(snapFd);
+    return;
+  }
+
+  bool ok;
+  if (isOverlay(&header))
+  {
+    syncDisk();
+    ok = copyImage(fsfd, newFd);
+
+    uint8_t record[sizeof(uint32_t) + BLOCK_SIZE];
+    for (off_t pos = sizeof(Snapshot_header); ok && (pread(snapFd, record, sizeof(record), pos) == (int)sizeof(record)); pos += sizeof(record))
+    {
+      uint32_t page;
+      memcpy(&page, record, sizeof(uint32_t));
+      ok = (pwrite(newFd, record + sizeof(uint32_t), BLOCK_SIZE, (off_t)page * BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    ok = ok && (ftruncate(newFd, header.imageSize) == 0);
+  }
+  else
+  {
+    ok = copyImage(snapFd, newFd);
+  }
+  if (!ok)
+  {
+    outPrintf(stderr, "Error: Cannot create disk %s\n", new_disk_name);
+  }
+  close(newFd);
+  close(snapFd);
+}
+
+void fs_rollback(char *name)
+{
+  /* fs_rollback returns the mounted disk to the state saved in snapshot
+     name, discarding all changes made since, and mounts it again. An overlay
+     snapshot puts back just the pages saved in it and starts over empty;
+     a reflinked snapshot is reflinked back over the disk file.
+     Input: name - name of the snapshot
+     Output: None
+  */
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  Snapshot_header header;
+  int snapFd = openSnapshotFile(name, &header);
+  if (snapFd < 0)
+  {
+    return;
+  }
+
+  string path = snapshotPath(name);
+  off_t diskSize = lseek(fsfd, 0, SEEK_END);
+  if (isOverlay(&header))
+  {
+    // Other snapshots keep the pages the rollback drops or overwrites
+    if (diskSize > (off_t)header.imageSize)
+    {
+      preservePages(header.imageSize, diskSize - header.imageSize);
+    }
+
+    uint8_t record[sizeof(uint32_t) + BLOCK_SIZE];
+    for (off_t pos = sizeof(Snapshot_header); pread(snapFd, record, sizeof(record), pos) == (int)sizeof(record); pos += sizeof(record))
+    {
+      uint32_t page;
+      memcpy(&page, record, sizeof(uint32_t));
+      off_t offset = (off_t)page * BLOCK_SIZE;
+      diskWrite(record + sizeof(uint32_t), min((off_t)BLOCK_SIZE, (off_t)header.imageSize - offset), offset, -1);
+    }
+    ftruncate(fsfd, header.imageSize);
+
+    for (int i = 0; i < (int)snapshots.size(); i++)
+    {
+      if (snapshots[i].path == path)
+      {
+        ftruncate(snapshots[i].fd, sizeof(Snapshot_header));
+        lseek(snapshots[i].fd, 0, SEEK_END);
+        snapshots[i].saved.assign(snapshots[i].saved.size(), false);
+      }
+    }
+  }
+  else
+  {
+    preservePages(0, max(diskSize, lseek(snapFd, 0, SEEK_END)));
+    if (!copyImage(snapFd, fsfd) || (ftruncate(fsfd, lseek(snapFd, 0, SEEK_END)) != 0))
+    {
+      outPrintf(stderr, "Error: Cannot roll back to snapshot %s\n", name);
+    }
+  }
+  close(snapFd);
+
+  if (syncState.mode != DURABILITY_NONE)
+  {
+    fdatasync(fsfd);
+  }
+
+  // Drop the in-memory state of the disk, which the rollback made stale
+  string diskName = info.diskName;
+  close(fsfd);
+  fsMounted = false;
+  closeSnapshots();
+  fs_mount(&diskName[0]);
+}
+
+void fs_resize(char name[5], int new_size)
+{
+  /* fs_resize resizes file of given name in the current directory to the given
+     new size.
+     Input: name - name of file to be resized
+            new_size - size to resize to
+     Output: None
+  */
+  int inodeIndex, fileSize, startBlockIdx;
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  char tempName[6] = {name[0], name[1], name[2], name[3], name[4], 0};
+  inodeIndex = getChildInode(name);
+
+  if (inodeIndex < 0)
+  {
+    outPrintf(stderr, "Error: File %s does not exist\n", tempName);
+    return;
+  }
+
+  if (inodeIsDirectory(inodeIndex))
+  {
+    outPrintf(stderr, "Error: File %s does not exist\n", tempName);
+    return;
+  }
+
+  fileSize = getFileSize(inodeIndex);
+  startBlockIdx = getStartBlock(inodeIndex);
+  traceFile(inodeIndex, startBlockIdx);
+  touchFile(inodeIndex, info.resizes);
+
+  if (new_size == fileSize)
+  {
+    // Already this size, no need to resize
+    return;
+  }
+  else if (new_size < fileSize)
+  {
+    // Delete and zero out blocks from tail of block sequence for this file and update free block list
+    char tempBuff[BLOCK_SIZE];
+    memset(tempBuff, 0, BLOCK_SIZE);
+
+    for (int i = 0; i < fileSize; i++)
+    {
+      if (i >= new_size)
+      {
+        writeBlock(startBlockIdx+i, tempBuff);
+        setFreeBlockBit((startBlockIdx+i), 0);
+      }
+    }
+    setFileSize(inodeIndex, new_size);
+  }
+  else // new_size > fileSize
+  {
+    int freeByteCounter = startBlockIdx + fileSize;
+    bool saveable = false;
+    int consecFree = 0;
+
+    while (freeByteCounter < 128)
+    {
+      bool blockInUse = getFreeBlockBit(freeByteCounter);
+      if (blockInUse)
+      {
+        break;
+      }
+      else
+      {
+        consecFree++;
+        if (consecFree >= (new_size - fileSize))
+        {
+          saveable = true;
+          break;
+        }
+      }
+      freeByteCounter++;
+    }
+    if (saveable) // can append new blocks to end without moving start_block
+    {
+      for (int j = (startBlockIdx+fileSize); j < (startBlockIdx+new_size); j++)
+      {
+        setFreeBlockBit(j, 1);
+      }
+      setFileSize(inodeIndex, new_size);
+    }
+    else
+    {
+      // Count free blocks right before the file; with the free blocks after it
+      // they may be enough to grow in place by shifting the file down
+      int freeBefore = 0;
+      while ( (startBlockIdx - freeBefore - 1 >= 1) &&
+              !getFreeBlockBit(startBlockIdx - freeBefore - 1) )
+      {
+        freeBefore++;
+      }
+
+      if (freeBefore + consecFree >= new_size - fileSize)
+      {
+        // Shift down only as far as needed; the blocks vacated at the old tail
+        // stay in the file and are zeroed by moveBlocks
+        int newStartBlockIdx = startBlockIdx - (new_size - fileSize - consecFree);
+        moveBlocks(startBlockIdx, newStartBlockIdx, fileSize);
+
+        for (int k = 0; k < new_size; k++)
+        {
+          setFreeBlockBit((newStartBlockIdx+k), 1);
+        }
+        superblock.inode[inodeIndex].start_block = newStartBlockIdx;
+        setFileSize(inodeIndex, new_size);
+        return;
+      }
+
+      // Can't grow in place; need to move file to another run
+      char tempFreeBlockList[16];
+      memcpy(tempFreeBlockList, superblock.free_block_list, 16);
+
+      for (int k = 0; k < fileSize; k++)
+      {
+        setFreeBlockBit((startBlockIdx+k), 0);
+      }
+
+      // A file resized often gets room to grow again in place: half its new
+      // size, or its latest growth if larger, less if that does not fit
+      int newStartBlockIdx = -1;
+      int slack = (heatPlacement && (info.resizes[inodeIndex] >= HOT_RESIZES)) ? max(new_size / 2, new_size - fileSize) : 0;
+      for (; (newStartBlockIdx < 0) && (slack > 0); slack /= 2)
+      {
+        newStartBlockIdx = findSlackRun(new_size, slack);
+      }
+      if (newStartBlockIdx < 0)
+      {
+        newStartBlockIdx = findFreeRun(new_size);
+      }
+
+      if (newStartBlockIdx >= 0) // contiguous number of free blocks found
+      {
+        stats.relocations++;
+        // Move mem from old start block to new (clearing old blocks) and set free block bits
+        moveBlocks(startBlockIdx, newStartBlockIdx, fileSize);
+
+        for (int k=0; k < new_size; k++)
+        {
+          setFreeBlockBit((newStartBlockIdx+k), 1);
+        }
+
+        // Update start block and size
+        superblock.inode[inodeIndex].start_block = newStartBlockIdx;
+        setFileSize(inodeIndex, new_size);
+      }
+      else
+      {
+        // Not saveable; restore free block bits and print error message
+        memcpy(superblock.free_block_list, tempFreeBlockList, 16);
+        outPrintf(stderr, "Error: File %s cannot expand to size %d\n", tempName, new_size);
+      }
+    }
+  }
+}
+
+void fs_defrag(void)
+{
+  /* fs_defrag rearranges file blocks in memory so that there are no free
+     blocks between used blocks, and between the superblock and used blocks.
+     Input: None
+     Output: None
+  */
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  // Right after another defrag there is nothing to move
+  if (checkOnly)
+  {
+    return;
+  }
+
+  if (heatPlacement)
+  {
+    heatDefrag();
+    return;
+  }
+
+  // Create list of file inodes sorted by smallest start_block to largest
+  priority_queue<int, vector<int>, cmpStartBlock> q;
+  for (int i = 0; i < 126; i++)
+  {
+    if (superblock.inode[i].start_block != 0)
+    {
+      q.push(i);
+    }
+  }
+
+  int firstFreeBlock = 1;
+  while (!q.empty())
+  {
+    int newStartBlockIdx, fileSize;
+    int inodeIndex = q.top();
+    int startBlockIdx = getStartBlock(inodeIndex);
+    fileSize = getFileSize(inodeIndex);
+    traceFile(inodeIndex, startBlockIdx);
+
+    while (firstFreeBlock < startBlockIdx)
+    {
+      if (!getFreeBlockBit(firstFreeBlock))
+      {
+        break;
+      }
+      firstFreeBlock++;
+    }
+
+    if (firstFreeBlock >= startBlockIdx) // no need to shift, already at smallest free data block
+    {
+      q.pop();
+      firstFreeBlock = startBlockIdx+fileSize;
+      continue;
+    }
+    else
+    {
+      newStartBlockIdx = firstFreeBlock;
+      moveFile(inodeIndex, newStartBlockIdx);
+    }
+    firstFreeBlock = newStartBlockIdx+fileSize;
+    q.pop();
+  }
+
+}
+
+void fs_cd(char name[5])
+{
+  /* fs_cd changes current working directory to the one specified.
+     Input: name - name of directory to change into
+     Output: None
+  */
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+
+  if (strcmp(name, ".") == 0) // current directory
+  {
+    // Already there
+    return;
+  }
+  else if (strcmp(name, "..") == 0) // parent directory
+  {
+    if (info.currWorkDir == 127)
+    {
+      // At root; nowhere to go
+      return;
+    }
+    else
+    {
+      // Set current working directory to parent directory of current inode
+      Meta_version *meta = pinMetadata();
+      info.currWorkDir = meta->superblock.inode[info.currWorkDir].dir_parent & 0x7F;
+      unpinMetadata();
+    }
+  }
+  else // child directory (maybe)
+  {
+    Meta_version *meta = pinMetadata();
+    int inodeIndex = findItem(meta, info.currWorkDir, name);
+    bool isDir = (inodeIndex >= 0) && (meta->superblock.inode[inodeIndex].dir_parent & 0x80);
+    unpinMetadata();
+
+    if (inodeIndex < 0)
+    {
+      outPrintf(stderr, "Error: Directory %s does not exist\n", name);
+      return;
+    }
+
+     // Is it, in fact, a child directory?
+     if (isDir)
+     {
+       info.currWorkDir = inodeIndex;
+     }
+     else // nah
+     {
+       outPrintf(stderr, "Error: Directory %s does not exist\n", name);
+     }
+  }
+}
+
+void fs_metrics(void)
+{
+  /* fs_metrics prints a histogram of free extent sizes (power of two buckets),
+     the largest free run and the fragmentation index of the mounted disk. The
+     fragmentation index is 1 - largest free run / free blocks, so 0 means all
+     free space is contiguous.
+     Input: None
      Output: None
   */
   if (!fsMounted)
   {
-    fprintf(stderr, "Error: No file system is mounted\n");
+    outPrintf(stderr, "Error: No file system is mounted\n");
     return;
   }
 
-  int neededBlocks = size;
+  vector<pair<int, int> > runs = getFreeRuns();
+  int freeBlocks = 0;
+  int largestRun = 0;
+  int histogram[8] = {0}; // bucket b holds runs of length [2^b, 2^(b+1))
 
-  if (info.freeInodeIndexes.empty())
+  for (int i = 0; i < (int)runs.size(); i++)
   {
-    fprintf(stderr, "Error: Superblock in disk %s is full, cannot create %s\n", info.diskName.c_str(), name);
+    int bucket = 0;
+    while ((2 << bucket) <= runs[i].second)
+    {
+      bucket++;
+    }
+    histogram[bucket]++;
+    freeBlocks += runs[i].second;
+    largestRun = max(largestRun, runs[i].second);
   }
 
-  vector<string> tempDirs = info.directories[info.currWorkDir];
+  double fragIndex = (freeBlocks > 0) ? 1.0 - (double)largestRun / freeBlocks : 0.0;
 
-  char tempName[6] = {name[0], name[1], name[2], name[3], name[4], '\0'};
+  outPrintf(stdout, "Free blocks: %d in %d extents\n", freeBlocks, (int)runs.size());
+  outPrintf(stdout, "Largest free run: %d\n", largestRun);
+  outPrintf(stdout, "Fragmentation index: %.3f\n", fragIndex);
+  for (int b = 0; b < 8; b++)
+  {
+    if (histogram[b] > 0)
+    {
+      outPrintf(stdout, "Extents %3d-%-3d: %d\n", 1 << b, (2 << b) - 1, histogram[b]);
+    }
+  }
 
-  if ( (find(tempDirs.begin(), tempDirs.end(), string(tempName)) != tempDirs.end()) ||
-       (strcmp(name, ".") == 0) || (strcmp(name, "..") == 0) )
+  if (info.compressed)
   {
-    // Not unique name in this directory
-    fprintf(stderr, "Error: File or directory %s already exists\n", name);
+    // Physical usage of the slot heap
+    int storedBlocks = 0;
+    int storedBytes = 0;
+    for (int i = 1; i < NUM_BLOCKS; i++)
+    {
+      if (slotBytes(slotMap.slot[i]) > 0)
+      {
+        storedBlocks++;
+      }
+    }
+    for (map<int, int>::iterator it = slotRefs.begin(); it != slotRefs.end(); ++it)
+    {
+      for (int i = 1; i < NUM_BLOCKS; i++)
+      {
+        if ((slotBytes(slotMap.slot[i]) > 0) && (slotMap.slot[i].offset == it->first))
+        {
+          storedBytes += slotBytes(slotMap.slot[i]);
+          break;
+        }
+      }
+    }
+    outPrintf(stdout, "Slots: %d blocks in %d slots, %d bytes, heap %d bytes\n", storedBlocks,
+              (int)slotRefs.size(), storedBytes, heapEnd()*SLOT_GRANULE);
+  }
+}
+
+void fs_scrub(void)
+{
+  /* fs_scrub verifies every data block of the mounted disk against the
+     checksum table, reporting each corrupt block.
+     Input: None
+     Output: None
+  */
+  if (!fsMounted)
+  {
+    outPrintf(stderr, "Error: No file system is mounted\n");
+    return;
+  }
+  if (!checksumsEnabled)
+  {
+    outPrintf(stderr, "Error: Checksums are not enabled\n");
     return;
   }
 
-  if (size == 0) // creating a directory
+  vector<uint8_t> data(BLOCK_SIZE*(NUM_BLOCKS-1));
+  readBlocks(1, &data[0], NUM_BLOCKS-1);
+
+  int corrupt = 0;
+  for (int i = 1; i < NUM_BLOCKS; i++)
   {
-    // Store attributes into first available inode
-    Inode tempInode;
-    for (int i = 0; (i < 5) && (name[i] != '\0'); i++)
+    if (!blockChecksumOk(i, &data[BLOCK_SIZE*(i-1)]))
     {
-      tempInode.name[i] = name[i];
+      outPrintf(stderr, "Error: Checksum mismatch in block %d of disk %s\n", i, info.diskName.c_str());
+      corrupt++;
     }
-    tempInode.used_size = (uint8_t)size | 0x80;
-    tempInode.dir_parent = info.currWorkDir | 0x80;
+  }
+  outPrintf(stdout, "Scrubbed %d blocks, %d corrupt\n", NUM_BLOCKS-1, corrupt);
+}
 
-    superblock.inode[info.freeInodeIndexes[0]] = tempInode;
+int replayTrace(char *tracePath, char *imagePath, bool maxSpeed)
+{
+  /* Re-issues the reads and writes recorded in a trace file against a disk
+     image, either at the recorded pace or as fast as possible. Traces do not
+     hold block contents, so writes put zeroes down and the image should be
+     a scratch copy.
+     Input: tracePath - trace file written with --trace
+            imagePath - disk image to replay against
+            maxSpeed - ignore recorded timestamps
+     Output: 0 on success, -1 on error
+  */
+  int traceFd = open(tracePath, O_RDONLY);
+  if (traceFd < 0)
+  {
+    outPrintf(stderr, "Could not open trace file %s\n", tracePath);
+    return -1;
+  }
+
+  Trace_header header;
+  if ( (read(traceFd, &header, sizeof(Trace_header)) != (int)sizeof(Trace_header)) ||
+       (strncmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) ||
+       (header.recordSize != sizeof(Trace_record)) )
+  {
+    outPrintf(stderr, "Invalid trace file %s\n", tracePath);
+    close(traceFd);
+    return -1;
+  }
 
-    // Update directories info
-    info.directories[info.currWorkDir].push_back((string)name);;
-    info.dirChildInodes[info.currWorkDir].push_back(info.freeInodeIndexes[0]);
+  vector<Trace_record> records;
+  Trace_record chunk[TRACE_RING_SIZE];
+  int bytesRead;
+  while ((bytesRead = read(traceFd, chunk, sizeof(chunk))) > 0)
+  {
+    records.insert(records.end(), chunk, chunk + bytesRead/sizeof(Trace_record));
+  }
+  close(traceFd);
 
-    info.freeInodeIndexes.erase(info.freeInodeIndexes.begin());
+  int imageFd = open(imagePath, O_RDWR);
+  if (imageFd < 0)
+  {
+    outPrintf(stderr, "Error: Cannot find disk %s\n", imagePath);
+    return -1;
   }
-  else if ((size < 0) || (size > 127)) // impossible to store files of size outside [1,127] blocks
+
+  uint32_t maxBytes = BLOCK_SIZE;
+  for (int i = 0; i < (int)records.size(); i++)
   {
-    fprintf(stderr, "Error: Cannot allocate %d on %s\n", size, info.diskName.c_str());
-    return;
+    maxBytes = max(maxBytes, records[i].bytes);
   }
-  else // creating a file. find first set of continuous free blocks that can store file
+  vector<uint8_t> data(maxBytes, 0);
+
+  int reads = 0, writes = 0;
+  long long readBytes = 0, writeBytes = 0;
+  double recordedMillis = 0, replayedMillis = 0;
+  struct timespec start, before, after;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (int i = 0; i < (int)records.size(); i++)
   {
-    // Go through free block section and read each bit until N consecutive free blocks are found
-    int freeByteCounter = 0;
-    int consecFree = 0;
-    bool saveable = false;
-    bitset<8> curByte;
-    while (freeByteCounter < 128)
+    Trace_record *rec = &records[i];
+    if (!maxSpeed)
     {
-      bool blockInUse = getFreeBlockBit(freeByteCounter);
-      if (blockInUse)
+      // Wait until the same time since start as when the I/O was recorded
+      clock_gettime(CLOCK_MONOTONIC, &before);
+      long long waitNanos = rec->timestamp - (long long)(elapsedMillis(start, before) * 1000000);
+      if (waitNanos > 0)
       {
-        consecFree = 0;
+        struct timespec wait = {(time_t)(waitNanos / 1000000000), (long)(waitNanos % 1000000000)};
+        nanosleep(&wait, NULL);
       }
-      else
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    if (rec->op == 'R')
+    {
+      if (pread(imageFd, &data[0], rec->bytes, rec->offset) < 0)
       {
-        consecFree++;
-        if (consecFree >= neededBlocks)
-        {
-          saveable = true;
-          break;
-        }
+        outPrintf(stderr, "Error: Replay read failed at offset %u\n", rec->offset);
       }
-      freeByteCounter++;
+      reads++;
+      readBytes += rec->bytes;
     }
-    if (saveable)
+    else
     {
-      // Store attributes into first available inode
-      Inode tempInode;
-      for (int i = 0; i < 5; i++)
+      if (pwrite(imageFd, &data[0], rec->bytes, rec->offset) < 0)
       {
-        tempInode.name[i] = name[i];
+        outPrintf(stderr, "Error: Replay write failed at offset %u\n", rec->offset);
       }
-      tempInode.used_size = (uint8_t)size | 0x80;
-      tempInode.dir_parent = info.currWorkDir & 0x7F;
-      tempInode.start_block = freeByteCounter - neededBlocks + 1;
-
-      superblock.inode[info.freeInodeIndexes[0]] = tempInode;
+      writes++;
+      writeBytes += rec->bytes;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    replayedMillis += elapsedMillis(before, after);
+    recordedMillis += rec->latency / 1000000.0;
+  }
+  close(imageFd);
 
-      // Update directories info
-      info.directories[info.currWorkDir].push_back((string)name);;
-      info.dirChildInodes[info.currWorkDir].push_back(info.freeInodeIndexes[0]);
-      info.freeInodeIndexes.erase(info.freeInodeIndexes.begin());
+  clock_gettime(CLOCK_MONOTONIC, &after);
+  outPrintf(stdout, "Replayed %d reads (%lld bytes) and %d writes (%lld bytes) in %.3f ms\n",
+            reads, readBytes, writes, writeBytes, elapsedMillis(start, after));
+  outPrintf(stdout, "I/O time recorded %.3f ms, replayed %.3f ms\n", recordedMillis, replayedMillis);
+  return 0;
+}
 
-      // Update superblock's free block list
-      for (int j = tempInode.start_block; j < (tempInode.start_block + neededBlocks); j++)
-      {
-        setFreeBlockBit(j, 1);
-      }
-    }
-    else
+int findSpecChild(int parent, const char *name)
+{
+  /* Returns inode of the file or directory called name in directory parent
+     of superblock, or -1 if there is none
+  */
+  for (int i = 0; i < 126; i++)
+  {
+    Inode *inode = &superblock.inode[i];
+    if ( (inode->used_size & 0x80) && ((inode->dir_parent & 0x7F) == parent) &&
+         (strncmp(inode->name, name, 5) == 0) )
     {
-      fprintf(stderr, "Error: Cannot allocate %d on %s\n", size, info.diskName.c_str());
-      return;
+      return i;
     }
   }
+  return -1;
 }
 
-void fs_delete(char name[5])
+bool buildImageSuperblock(char *specPath)
 {
-  /* fs_delete checks for and delete file/directory of name in the current
-     working directory.
-     Input: name - name of the directory or file being deleted
-     Output: None
+  /* Builds the superblock of a new disk image in superblock. Each line of the
+     spec file (if any) is "<path> <size>", creating a file of size blocks or
+     a directory if size is 0, just like the C command. Path components are
+     separated by '/' and parents must be listed before their children.
+     Input: specPath - spec file, or NULL for an empty image
+     Output: true on success, false if the spec is invalid
   */
-  if (!fsMounted)
+  memset(&superblock, 0, sizeof(Super_block));
+  setFreeBlockBit(0, 1);
+  if (specPath == NULL)
   {
-    fprintf(stderr, "Error: No file system is mounted\n");
-    return;
+    return true;
   }
 
-  int sharedIdx = getIndexInDir(name);
-  char tempName[6] = {name[0], name[1], name[2], name[3], name[4], 0};
-
-  // Check if specified file or directory is in current working directory
-  if ( sharedIdx < 0 )
+  FILE *spec = fopen(specPath, "r");
+  if (spec == NULL)
   {
-    fprintf(stderr, "Error: File or directory %s does not exist\n", tempName);
-    return;
+    outPrintf(stderr, "Could not open spec file %s\n", specPath);
+    return false;
   }
 
-  // File or dir exists! Time to delete
-  int inodeIndex = getInodeIndex(sharedIdx);
-
-  if (!inodeIsDirectory(inodeIndex))
+  char line[MAX_INPUT_LENGTH];
+  int lineCounter = 0;
+  int nextInode = 0;
+  bool ok = true;
+  while (ok && (fgets(line, MAX_INPUT_LENGTH, spec) != NULL))
   {
-    // Is a file. Need to zero out used mem blocks and update free block list
-    int startBlockIdx = getStartBlock(inodeIndex);
-    int fileSize = getFileSize(inodeIndex);
-
-    char tempBuff[BLOCK_SIZE];
-    memset(tempBuff, 0, BLOCK_SIZE);
+    lineCounter++;
+    char path[MAX_INPUT_LENGTH];
+    int size;
+    char extra;
+    if ((line[0] == '#') || (sscanf(line, " %c", &extra) != 1))
+    {
+      continue; // comment or blank line
+    }
+    if ( (sscanf(line, "%s %d %c", path, &size, &extra) != 2) || (size < 0) || (size > 127) )
+    {
+      outPrintf(stderr, "Spec Error: %s, %d\n", specPath, lineCounter);
+      ok = false;
+      break;
+    }
 
-    for (int i = 0; i < fileSize; i++)
+    // Walk to the parent directory of the last path component
+    int parent = 127;
+    char *name = strtok(path, "/");
+    char *next = (name != NULL) ? strtok(NULL, "/") : NULL;
+    while ((name != NULL) && (next != NULL))
     {
-      lseek(fsfd, BLOCK_SIZE*(startBlockIdx+i), SEEK_SET);
-      write(fsfd, tempBuff, BLOCK_SIZE);
-      setFreeBlockBit((startBlockIdx+i), 0);
+      parent = findSpecChild(parent, name);
+      if ((parent < 0) || !inodeIsDirectory(parent))
+      {
+        parent = -1;
+        break;
+      }
+      name = next;
+      next = strtok(NULL, "/");
     }
-  }
-  else // is a directory, need to recursively delete
-  {
-    // Update current work directory
-    int tempCurrWorkDir = info.currWorkDir;
-    info.currWorkDir = inodeIndex;
 
-    int itSize = info.directories[info.currWorkDir].size();
+    if ( (name == NULL) || (parent < 0) || (strlen(name) > 5) ||
+         (strcmp(name, ".") == 0) || (strcmp(name, "..") == 0) || (findSpecChild(parent, name) >= 0) )
+    {
+      outPrintf(stderr, "Spec Error: %s, %d\n", specPath, lineCounter);
+      ok = false;
+      break;
+    }
+    if (nextInode == 126)
+    {
+      outPrintf(stderr, "Error: Superblock is full, cannot create %s\n", name);
+      ok = false;
+      break;
+    }
 
-    // Get list of names for directory and loop through them with fs_delete
-    for (int j = 0; j < itSize; j++)
+    Inode *inode = &superblock.inode[nextInode++];
+    strncpy(inode->name, name, 5);
+    inode->used_size = (uint8_t)size | 0x80;
+    if (size == 0)
     {
-      string str = info.directories[info.currWorkDir][0];
-      char tempName[5];
-      strncpy(tempName, str.c_str(), 5);
-      fs_delete(tempName);
+      inode->dir_parent = parent | 0x80;
+      continue;
     }
 
-    // Restore current work directory
-    info.currWorkDir = tempCurrWorkDir;
+    int startBlockIdx = findFreeRun(size);
+    if (startBlockIdx < 0)
+    {
+      outPrintf(stderr, "Error: Cannot allocate %d for %s\n", size, name);
+      ok = false;
+      break;
+    }
+    inode->dir_parent = parent & 0x7F;
+    inode->start_block = startBlockIdx;
+    for (int j = startBlockIdx; j < startBlockIdx + size; j++)
+    {
+      setFreeBlockBit(j, 1);
+    }
   }
-
-  memset(&(superblock.inode[inodeIndex]), 0, sizeof(Inode));  // Set inode to 0
-
-  // Update info on directories
-  info.directories[info.currWorkDir].erase(info.directories[info.currWorkDir].begin() + sharedIdx);
-  info.dirChildInodes[info.currWorkDir].erase(info.dirChildInodes[info.currWorkDir].begin() + sharedIdx);
-
-  // Update and sort list of free inodes
-  info.freeInodeIndexes.push_back(inodeIndex);
-  sort(info.freeInodeIndexes.begin(), info.freeInodeIndexes.end());
+  fclose(spec);
+  return ok;
 }
 
-void fs_read(char name[5], int block_num)
+int createImage(char *imagePath)
 {
-  /* fs_read checks for and reads a KB block from file in the current
-     working directory into the buffer.
-     Input: name - name of the file being read
-            block_num - index of block in file to read
-     Output: None
+  /* Creates a disk image holding the superblock built by buildImageSuperblock.
+     The data blocks are allocated without being written, so all files read
+     back as zeroes, and the superblock goes down in one write.
+     Input: imagePath - disk image to create, replaced if it exists
+     Output: 0 on success, -1 on error
   */
-  if (!fsMounted)
+  int fd = open(imagePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
   {
-    fprintf(stderr, "Error: No file system is mounted\n");
-    return;
+    outPrintf(stderr, "Error: Cannot create disk %s\n", imagePath);
+    return -1;
   }
 
-  int sharedIdx = getIndexInDir(name);
-  char tempName[6] = {name[0], name[1], name[2], name[3], name[4], 0};
-
-  if (sharedIdx < 0)
+  // Reserve space up front where the file system supports it, otherwise
+  // leave the image sparse
+  off_t imageSize = (off_t)NUM_BLOCKS*BLOCK_SIZE;
+  if ( (fallocate(fd, 0, 0, imageSize) != 0) && (ftruncate(fd, imageSize) != 0) )
   {
-    fprintf(stderr, "Error: File %s does not exist\n", tempName);
-    return;
+    outPrintf(stderr, "Error: Cannot allocate disk %s\n", imagePath);
+    close(fd);
+    return -1;
   }
 
-  int inodeIndex = getInodeIndex(sharedIdx);
-  if (inodeIsDirectory(inodeIndex))
+  if (pwrite(fd, &superblock, BLOCK_SIZE, 0) != BLOCK_SIZE)
   {
-    fprintf(stderr, "Error: File %s does not exist\n", tempName);
-    return;
+    outPrintf(stderr, "Error: Cannot write superblock of disk %s\n", imagePath);
+    close(fd);
+    return -1;
   }
+  close(fd);
+  return 0;
+}
 
-  int fileSize = getFileSize(inodeIndex);
+bool encodedPayload(const char *input)
+{
+  /* Checks if input line is a B command with an encoded payload */
+  size_t opLength = strcspn(input, " ");
+  return (input[0] == 'B') && (memchr(input, ':', opLength) != NULL);
+}
 
-  if ( (block_num < 0) || (block_num > (fileSize - 1)) )
+int parseRegister(const char *text)
+{
+  /* Returns the buffer register numbered by text, or -1 if text is not a
+     register number
+  */
+  int reg = 0;
+  for (int i = 0; text[i] != '\0'; i++)
   {
-    fprintf(stderr, "Error: %s does not have block %d\n", tempName, block_num);
-    return;
+    if ((text[i] < '0') || (text[i] > '9') || (i == 2))
+    {
+      return -1;
+    }
+    reg = reg*10 + (text[i] - '0');
   }
-
-  // Otherwise, block of file exists. Read it into the buffer
-  int startBlockIdx = getStartBlock(inodeIndex);
-
-  lseek(fsfd, BLOCK_SIZE*(startBlockIdx+block_num), SEEK_SET);
-  read(fsfd, &buffer, BLOCK_SIZE);
+  return ((text[0] != '\0') && (reg < NUM_REGISTERS)) ? reg : -1;
 }
 
-void fs_write(char name[5], int block_num)
+void parseCommand(char *input, int line, Command *cmd)
 {
-  /* fs_write writes current contents of buffer into specified block of file.
-     Input: name - name of the file being written to
-            block_num - index of block in file to write to
+  /* Splits a line of the input file into a command and checks its format.
+     Lines with a bad format get op 0, which reports a Command Error when run.
+     Input: input - line without its trailing newline, modified by tokenize
+            line - line number in input file
+            cmd - command to fill in
      Output: None
   */
-  if (!fsMounted)
+  char *tokArgs[MAX_INPUT_LENGTH] = {NULL};
+  cmd->op = 0;
+  cmd->line = line;
+  cmd->arg[0] = '\0';
+  cmd->reg = -1;
+  cmd->checkOnly = false;
+
+  // Split into space-separated strings
+  tokenize(input, " ", &tokArgs[0]);
+  int numArgs = 0;
+  while (tokArgs[numArgs+1] != NULL)
   {
-    fprintf(stderr, "Error: No file system is mounted\n");
-    return;
+    numArgs++;
   }
 
-  int sharedIdx = getIndexInDir(name);
-  char tempName[6] = {name[0], name[1], name[2], name[3], name[4], 0};
+  // B may give the encoding of its payload, as in "B:hex" or "B@3:b64"
+  char *encoding = NULL;
+  if ((tokArgs[0][0] == 'B') && ((encoding = strchr(tokArgs[0], ':')) != NULL))
+  {
+    *encoding++ = '\0';
+  }
 
-  if (sharedIdx < 0)
+  // B, R and W may name a buffer register, as in "B@3"
+  if ((tokArgs[0][1] == '@') && (strchr("BRW", tokArgs[0][0]) != NULL))
+  {
+    cmd->reg = parseRegister(&tokArgs[0][2]);
+    if (cmd->reg < 0)
+    {
+      return;
+    }
+  }
+  else if (strlen(tokArgs[0]) != 1)
   {
-    fprintf(stderr, "Error: File %s does not exist\n", tempName);
     return;
   }
 
-  int inodeIndex = getInodeIndex(sharedIdx);
-  if (inodeIsDirectory(inodeIndex))
+  // Check number of args, and that names in paths are no longer than 5
+  // chars. Only Y and L can be given root itself.
+  bool valid;
+  switch (tokArgs[0][0])
+  {
+    case 'M':
+      valid = (numArgs == 1);
+      break;
+    case 'Y':
+      valid = (numArgs == 1) && validPath(tokArgs[1]);
+      break;
+    case 'D':
+      valid = (numArgs == 1) && validPath(tokArgs[1]) && (strcmp(tokArgs[1], "/") != 0);
+      break;
+    case 'C': case 'R': case 'W': case 'E':
+      valid = (numArgs == 2) && validPath(tokArgs[1]) && (strcmp(tokArgs[1], "/") != 0);
+      break;
+    case 'B':
+      valid = (numArgs == 1) && ((encoding != NULL) || (strlen(tokArgs[1]) <= BLOCK_SIZE));
+      break;
+    case 'L': case 'U':
+      valid = (numArgs == 0) || ((numArgs == 1) && validPath(tokArgs[1]));
+      break;
+    case 'O': case 'G': case 'K':
+      valid = (numArgs == 0);
+      break;
+    case 'S': case 'Z':
+      valid = (numArgs == 1) && (strchr(tokArgs[1], '/') == NULL);
+      break;
+    case 'F':
+    {
+      // A name, or a name prefix followed by '*'
+      size_t nameLength = (numArgs == 1) ? strcspn(tokArgs[1], "/*") : 0;
+      valid = (numArgs == 1) && (nameLength <= 5) &&
+              ((tokArgs[1][nameLength] == '\0') || (strcmp(&tokArgs[1][nameLength], "*") == 0));
+      break;
+    }
+    case 'N':
+      valid = (numArgs == 2) && (strchr(tokArgs[1], '/') == NULL);
+      break;
+    case 'P':
+      valid = (numArgs == 2) && validPath(tokArgs[1]) && validPath(tokArgs[2]) && (strcmp(tokArgs[2], "/") != 0);
+      break;
+    case 'I': case 'X':
+      valid = (numArgs == 2) && validPath(tokArgs[1]) && (strcmp(tokArgs[1], "/") != 0);
+      break;
+    case 'V':
+      // Triples of register, file and block number
+      valid = (numArgs > 0) && (numArgs % 3 == 0);
+      for (int i = 1; valid && (i < numArgs); i += 3)
+      {
+        valid = (parseRegister(tokArgs[i]) >= 0) && validPath(tokArgs[i+1]) &&
+                (strcmp(tokArgs[i+1], "/") != 0) && (atoi(tokArgs[i+2]) >= 0) && (atoi(tokArgs[i+2]) <= 126);
+      }
+      break;
+    default:
+      valid = false;
+  }
+  if (!valid)
   {
-    fprintf(stderr, "Error: File %s does not exist\n", tempName);
     return;
   }
 
-  int fileSize = getFileSize(inodeIndex);
-
-  if ( (block_num < 0) || (block_num > (fileSize - 1)) )
+  // Sizes must be in [0, 127] to create and at least 1 to resize, block
+  // numbers in [0, 126]
+  cmd->number = (numArgs == 2) ? atoi(tokArgs[2]) : 0;
+  if ( ((tokArgs[0][0] == 'C') && ((cmd->number < 0) || (cmd->number > 127))) ||
+       ((tokArgs[0][0] == 'E') && (cmd->number < 1)) ||
+       (((tokArgs[0][0] == 'R') || (tokArgs[0][0] == 'W')) && ((cmd->number < 0) || (cmd->number > 126))) )
   {
-    fprintf(stderr, "Error: %s does not have block %d\n", tempName, block_num);
     return;
   }
 
-  // Otherwise, block of file exists. Read it into the buffer
-  int startBlockIdx = getStartBlock(inodeIndex);
-
-  lseek(fsfd, BLOCK_SIZE*(startBlockIdx+block_num), SEEK_SET);
-  write(fsfd, &buffer, BLOCK_SIZE);
+  if ((tokArgs[0][0] == 'B') && (encoding != NULL))
+  {
+    cmd->length = decodePayload(encoding, tokArgs[1], cmd->data);
+    if (cmd->length < 0)
+    {
+      return;
+    }
+  }
+  else if (tokArgs[0][0] == 'B')
+  {
+    cmd->length = strlen(tokArgs[1]);
+    memcpy(cmd->data, tokArgs[1], cmd->length);
+  }
+  else if (tokArgs[0][0] == 'V')
+  {
+    // Keep the triples, split again when run
+    for (int i = 1; i <= numArgs; i++)
+    {
+      strcat(cmd->arg, tokArgs[i]);
+      strcat(cmd->arg, (i < numArgs) ? " " : "");
+    }
+  }
+  else if (numArgs > 0)
+  {
+    // Pad with zeroes so names stored in inodes have no stray bytes
+    strncpy(cmd->arg, tokArgs[1], MAX_INPUT_LENGTH - 1);
+    cmd->arg[MAX_INPUT_LENGTH - 1] = '\0';
+    if ((tokArgs[0][0] == 'N') || (tokArgs[0][0] == 'I') || (tokArgs[0][0] == 'X') || (tokArgs[0][0] == 'P'))
+    {
+      strncpy(cmd->arg2, tokArgs[2], MAX_INPUT_LENGTH - 1);
+      cmd->arg2[MAX_INPUT_LENGTH - 1] = '\0';
+    }
+  }
+  cmd->op = tokArgs[0][0];
+}
+
+bool enterPath(const char *path, char op, char name[6])
+{
+  /* Makes the directory holding the last item of path the current working
+     directory and copies the item's name into name. For Y, L and U the item must
+     be a directory, which is entered itself, leaving name ".".
+     Input: path - path given to the command
+            op - command letter
+            name - set to name to pass to the command
+     Output: false, after printing an error, if a directory does not exist
+  */
+  int dir = resolvePath(path, name);
+  if ((dir >= 0) && ((op == 'Y') || (op == 'L') || (op == 'U')))
+  {
+    if (name[0] != '\0')
+    {
+      dir = lookupChild(dir, name);
+    }
+    memset(name, 0, 6);
+    name[0] = '.';
+  }
+  if ((dir < 0) || ((dir != 127) && !inodeIsDirectory(dir)))
+  {
+    outPrintf(stderr, "Error: Directory %s does not exist\n", path);
+    return false;
+  }
+
+  if (op == 'D')
+  {
+    // Deleting a directory holding the current working directory would
+    // leave it dangling
+    int target = lookupChild(dir, name);
+    bool isDir = (target == 127) || ((target >= 0) && inodeIsDirectory(target));
+    for (int cwd = info.currWorkDir; isDir; cwd = superblock.inode[cwd].dir_parent & 0x7F)
+    {
+      if (cwd == target)
+      {
+        outPrintf(stderr, "Error: Cannot delete %s, it holds the current working directory\n", path);
+        return false;
+      }
+      if (cwd == 127)
+      {
+        break;
+      }
+    }
+  }
+
+  info.currWorkDir = dir;
+  return true;
 }
 
-void fs_buff(uint8_t buff[BLOCK_SIZE])
+void runCommand(Command *cmd, const char *filename)
 {
-  /* fs_buff flushes and writes new characters into the buffer.
-     Input: buff - character array to replace contents of buffer with
+  /* Runs a parsed command, then syncs the disk as the durability mode
+     requires and records its latency.
+     Input: cmd - command from parseCommand
+            filename - input file, for Command Error messages
      Output: None
   */
-  if (!fsMounted)
+  struct timespec commandStart;
+  clock_gettime(CLOCK_MONOTONIC, &commandStart);
+  if (stats.latencies.empty())
   {
-    fprintf(stderr, "Error: No file system is mounted\n");
-    return;
+    stats.start = commandStart;
   }
-
-  // Flush buffer
-  memset(buffer, 0, BLOCK_SIZE);
-
-  // Write new bytes into buffer
-  for(int i=0; buff[i] != '\0'; i++)
+  tracer.command = cmd->op;
+  traceFile(-1, -1);
+
+  // Commands given a path run in the directory holding its last item
+  int workDir = info.currWorkDir;
+  char *name = cmd->arg;
+  char pathName[6];
+  bool takesPath = (cmd->op != 0) && (strchr("CDRWEYLUIX", cmd->op) != NULL);
+  bool hasPath = takesPath && ( (strchr(cmd->arg, '/') != NULL) ||
+                                (((cmd->op == 'L') || (cmd->op == 'U')) && (cmd->arg[0] != '\0')) );
+  if (hasPath && fsMounted)
   {
-    buffer[i] = buff[i];
+    name = pathName;
+    if (!enterPath(cmd->arg, cmd->op, pathName))
+    {
+      cmd->op = '-'; // reported, nothing to run
+    }
   }
-}
 
-void fs_ls(void)
-{
-  /* fs_ls prints out all items in the current working directory. Prints names
-     of files with their sizes and directories with their number of items.
-     Input: None
-     Output: None
-  */
-  if (!fsMounted)
+  ioBuffer = registerBuffer(cmd->reg);
+  checkOnly = cmd->checkOnly;
+  switch (cmd->op)
   {
-    fprintf(stderr, "Error: No file system is mounted\n");
-    return;
+    case 'M': fs_mount(name); break;
+    case 'C': fs_create(name, cmd->number); break;
+    case 'D': fs_delete(name); break;
+    case 'R': fs_read(name, cmd->number); break;
+    case 'W': fs_write(name, cmd->number); break;
+    case 'B': fillBuffer(cmd->data, cmd->length); break;
+    case 'L': fs_ls(); break;
+    case 'E': fs_resize(name, cmd->number); break;
+    case 'O': fs_defrag(); break;
+    case 'Y': fs_cd(name); break;
+    case 'G': fs_metrics(); break;
+    case 'K': fs_scrub(); break;
+    case 'U': fs_du(); break;
+    case 'S': fs_snapshot(cmd->arg); break;
+    case 'N': fs_clone(cmd->arg, cmd->arg2); break;
+    case 'Z': fs_rollback(cmd->arg); break;
+    case 'I': fs_import(name, cmd->arg2); break;
+    case 'X': fs_export(name, cmd->arg2); break;
+    case 'P': fs_copy(cmd->arg, cmd->arg2); break;
+    case 'V': fs_batch_write(cmd->arg); break;
+    case 'F': fs_find(cmd->arg); break;
+    case '-': break;
+    default:
+      // Not valid command
+      outPrintf(stderr, "Command Error: %s, %d\n", filename, cmd->line);
   }
 
-  int numChildren, size;
-  int parentDir = info.currWorkDir;
+  checkOnly = false;
 
-  // Print . for current directory and number of items inside
-  numChildren = info.directories[info.currWorkDir].size() + 2; // number of items inside directory, plus . and ..
-  printf("%-5s %3d\n", ".", numChildren);
+  // Publish metadata changed by the command for readers
+  if (fsMounted && (cmd->op != 0) && (strchr("MCDEOIPZ", cmd->op) != NULL))
+  {
+    publishMetadata();
+  }
 
-  // Print .. and number of items inside
-  // If currWorkDir is not root (127), need to find num of items in parent directory
-  if (info.currWorkDir != 127)
+  // Only Y stays in the directory its path led to
+  if (hasPath && fsMounted && (cmd->op != 'Y'))
   {
-    parentDir = superblock.inode[info.currWorkDir].dir_parent & 0x7F;
-    numChildren = info.dirChildInodes[parentDir].size() + 2;
+    info.currWorkDir = workDir;
   }
-  printf("%-5s %3d\n", "..", numChildren);
 
-  vector<int> tempChildInodes = info.dirChildInodes[info.currWorkDir];
-  sort(tempChildInodes.begin(), tempChildInodes.end());
+  // Sync disk if durability mode requires it
+  commandDone();
 
-  // Print name and size for each item in currWorkDir
-  for (int i = 0; i < (int)(info.dirChildInodes[info.currWorkDir].size()); i++)
+  if (stats.enabled)
   {
-    int child = tempChildInodes[i];
-    char * name = superblock.inode[child].name;
-    char tempName[6] = {name[0], name[1], name[2], name[3], name[4], '\0'};
-
-    if (inodeIsDirectory(child))
-    {
-      // Is directory, find number of items inside it
-      numChildren = info.dirChildInodes[child].size() + 2;
+    struct timespec commandEnd;
+    clock_gettime(CLOCK_MONOTONIC, &commandEnd);
+    stats.latencies.push_back(elapsedMillis(commandStart, commandEnd) * 1000.0);
+  }
+}
 
-      printf("%-5s %3d\n", tempName, numChildren);
-    }
-    else
+void idleDefrag(void)
+{
+  /* Defragments the mounted disk in steps of one file while no commands are
+     waiting, until its free blocks form one run or the idle defragmentation
+     budget is used up. Each step runs between commands on the executor
+     thread, so commands only ever see a disk before or after a step.
+  */
+  int budget = idleDefragBudget;
+  tracer.command = 'O';
+  while (fsMounted && ringEmpty(&commandQueue) && isFragmented())
+  {
+    int moved = defragStep(budget);
+    if (moved == 0)
     {
-      // Is file, get file size
-      size = getFileSize(child);
-      printf("%-5s %3d KB\n", tempName, size);
+      break;
     }
+    budget -= moved;
+    stats.idleDefragBlocks += moved;
+    publishMetadata();
+    commandDone();
   }
 }
 
-void fs_resize(char name[5], int new_size)
+void *executeCommands(void *filename)
 {
-  /* fs_resize resizes file of given name in the current directory to the given
-     new size.
-     Input: name - name of file to be resized
-            new_size - size to resize to
-     Output: None
+  /* Executor thread of pipelined mode. Runs queued commands in order until
+     the end of input, then ends the output.
   */
-  int sharedIdx, inodeIndex, fileSize, startBlockIdx;
-  if (!fsMounted)
+  while (true)
   {
-    fprintf(stderr, "Error: No file system is mounted\n");
-    return;
+    if ((idleDefragBudget > 0) && ringEmpty(&commandQueue))
+    {
+      idleDefrag();
+    }
+    Command *cmd = &commandRing[ringFront(&commandQueue, COMMAND_RING_SIZE)];
+    if (cmd->line == 0)
+    {
+      ringPop(&commandQueue);
+      break;
+    }
+    runCommand(cmd, (char *)filename);
+    ringPop(&commandQueue);
   }
 
-  char tempName[6] = {name[0], name[1], name[2], name[3], name[4], 0};
-  sharedIdx = getIndexInDir(name);
-
-  if (sharedIdx < 0)
-  {
-    fprintf(stderr, "Error: File %s does not exist\n", tempName);
-    return;
-  }
+  outputRing[ringReserve(&outputQueue, OUTPUT_RING_SIZE)].stream = NULL;
+  ringPublish(&outputQueue);
+  return NULL;
+}
 
-  inodeIndex = getInodeIndex(sharedIdx);
-  if (inodeIsDirectory(inodeIndex))
+void *writeOutput(void *unused)
+{
+  /* Output thread of pipelined mode. Writes queued output records in order
+     until the executor ends the output.
+  */
+  while (true)
   {
-    fprintf(stderr, "Error: File %s does not exist\n", tempName);
-    return;
+    Output_record *rec = &outputRing[ringFront(&outputQueue, OUTPUT_RING_SIZE)];
+    if (rec->stream == NULL)
+    {
+      ringPop(&outputQueue);
+      break;
+    }
+    outAppend(rec->stream, rec->text, rec->length);
+    ringPop(&outputQueue);
   }
+  return NULL;
+}
+bool readCommand(FILE *fp, char *input, size_t size, int *lineCounter, int *commandLine)
+{
+  /* Reads the next command from the input file into input, skipping empty
+     lines and joining encoded B payloads continued over several lines.
+     Input: fp - input file
+            input - set to command, without trailing newline
+            size - bytes in input
+            lineCounter - line number of next line in input file, advanced
+            commandLine - set to line number the command starts on
+     Output: false at end of input
+  */
+  while (fgets(input, MAX_INPUT_LENGTH, fp) != NULL) {
+    // Ignore line if just a newline character
+    if (input[0] == '\n')
+    {
+      (*lineCounter)++;
+      continue;
+    }
 
-  fileSize = getFileSize(inodeIndex);
-  startBlockIdx = getStartBlock(inodeIndex);
-
-  if (new_size == fileSize)
-  {
-    // Already this size, no need to resize
-    return;
-  }
-  else if (new_size < fileSize)
-  {
-    // Delete and zero out blocks from tail of block sequence for this file and update free block list
-    char tempBuff[BLOCK_SIZE];
-    memset(tempBuff, 0, BLOCK_SIZE);
+    // Remove trailing newline char
+    size_t len = strlen(input);
+    if (len > 0 && input[len - 1] == '\n')
+    {
+      input[--len] = '\0';
+    }
 
-    for (int i = 0; i < fileSize; i++)
+    // Encoded B payloads continue on the next line after a trailing '\'
+    *commandLine = *lineCounter;
+    while (encodedPayload(input) && (len > 0) && (input[len - 1] == '\\') &&
+           (len - 1 + MAX_INPUT_LENGTH <= size) &&
+           (fgets(&input[len - 1], MAX_INPUT_LENGTH, fp) != NULL))
     {
-      if (i >= new_size)
+      (*lineCounter)++;
+      len = strlen(input);
+      if (len > 0 && input[len - 1] == '\n')
       {
-        lseek(fsfd, BLOCK_SIZE*(startBlockIdx+i), SEEK_SET);
-        write(fsfd, tempBuff, BLOCK_SIZE);
-        setFreeBlockBit((startBlockIdx+i), 0);
+        input[--len] = '\0';
       }
     }
-    superblock.inode[inodeIndex].used_size = new_size | 0x80;
+    (*lineCounter)++;
+    return true;
   }
-  else // new_size > fileSize
+  return false;
+}
+
+void parseScriptLine(const Script_command &scriptLine, Command *cmd)
+{
+  /* Parses a command read into the script */
+  vector<char> input(scriptLine.text.begin(), scriptLine.text.end());
+  input.push_back('\0');
+  parseCommand(&input[0], scriptLine.line, cmd);
+  cmd->checkOnly = scriptLine.checkOnly;
+}
+
+int peephole(vector<Script_command> &script)
+{
+  /* Peephole pass over the whole script before it runs. Marks commands whose
+     effect is redundant so they only report their errors, as whether a disk
+     is mounted or a file exists is only known when they run:
+     - B whose buffer or register is filled by B again before a W or V uses it
+     - W of a block the same W (path and block) writes again, with only B, W,
+       V, L, U and F between, which neither read blocks nor change what the
+       path names
+     - O after another O with only B, L, U and F between
+     - C followed by D of the same path with only B between. If the C would
+       succeed, it just zeroes the blocks the D would have, and the D does
+       nothing. Idle defragmentation could see the item, so this is only
+       done without it.
+     Lines with a bad format only report a Command Error, so they may be
+     anywhere between.
+     Output: number of commands marked
+  */
+  int marked = 0;
+  vector<int> lastFill(NUM_REGISTERS + 1, -1); // index: register + 1, val: B with contents not used yet
+  map<pair<string, int>, int> lastWrite;  // key: (path, block), val: W of it since a command that could read it
+  int lastDefrag = -1;                    // O with only commands that leave blocks alone since
+  int lastCreate = -1;                    // C directly before, apart from B
+  string createPath;                      // path of lastCreate
+  Command cmd;
+
+  for (int i = 0; i < (int)script.size(); i++)
   {
-    int freeByteCounter = startBlockIdx + fileSize;
-    bool saveable = false;
-    int consecFree = 0;
+    parseScriptLine(script[i], &cmd);
+    char op = cmd.op;
+    bool listing = (op == 'L') || (op == 'U') || (op == 'F') || (op == 0);
 
-    while (freeByteCounter < 128)
+    // Buffers used by W and V
+    if (op == 'B')
     {
-      bool blockInUse = getFreeBlockBit(freeByteCounter);
-      if (blockInUse)
-      {
-        consecFree = 0;
-        break;
-      }
-      else
+      if (lastFill[cmd.reg + 1] >= 0)
       {
-        consecFree++;
-        if (consecFree >= (new_size - fileSize))
-        {
-          saveable = true;
-          break;
-        }
+        script[lastFill[cmd.reg + 1]].checkOnly = true;
+        marked++;
       }
-      freeByteCounter++;
+      lastFill[cmd.reg + 1] = i;
     }
-    if (saveable) // can append new blocks to end without moving start_block
+    else if (op == 'W')
     {
-      for (int j = (startBlockIdx+fileSize); j < (startBlockIdx+new_size); j++)
-      {
-        setFreeBlockBit(j, 1);
-      }
-      superblock.inode[inodeIndex].used_size = new_size | 0x80;
+      lastFill[cmd.reg + 1] = -1;
     }
-    else // can't extend; need to move start block
+    else if (op == 'V')
     {
-      freeByteCounter = 0;
-      saveable = false;
-
-      char tempFreeBlockList[16];
-      strncpy(tempFreeBlockList, superblock.free_block_list, 16);
-
-      for (int k = 0; k < fileSize; k++)
-      {
-        setFreeBlockBit((startBlockIdx+k), 0);
-      }
-
-      while (freeByteCounter < 128)
+      // Every third word names a register
+      char *savePtr;
+      int word = 0;
+      for (char *tok = strtok_r(cmd.arg, " ", &savePtr); tok != NULL; tok = strtok_r(NULL, " ", &savePtr), word++)
       {
-        bool blockInUse = getFreeBlockBit(freeByteCounter);
-        if (blockInUse)
-        {
-          consecFree = 0;
-        }
-        else
+        if (word % 3 == 0)
         {
-          consecFree++;
-          if (consecFree >= new_size)
-          {
-            saveable = true;
-            break;
-          }
+          lastFill[atoi(tok) + 1] = -1;
         }
-        freeByteCounter++;
       }
+    }
 
-      if (saveable) // contiguous number of free blocks found
+    // Blocks written again
+    if (!listing && (op != 'B') && (op != 'W') && (op != 'V'))
+    {
+      lastWrite.clear();
+    }
+    if (op == 'W')
+    {
+      pair<string, int> key = make_pair(string(cmd.arg), cmd.number);
+      if (lastWrite.count(key) > 0)
       {
-        // Copy mem from old start block to new and set free block bits
-        int newStartBlockIdx = freeByteCounter - new_size + 1;
-        char tempBuff[BLOCK_SIZE];
-        char emptyBuff[BLOCK_SIZE] = {0};
-
-        for (int k = 0; k < fileSize; k++)
-        {
-          lseek(fsfd, BLOCK_SIZE*(startBlockIdx+k), SEEK_SET);
-          read(fsfd, tempBuff, BLOCK_SIZE);
+        script[lastWrite[key]].checkOnly = true;
+        marked++;
+      }
+      lastWrite[key] = i;
+    }
 
-          lseek(fsfd, BLOCK_SIZE*(newStartBlockIdx+k), SEEK_SET);
-          write(fsfd, tempBuff, BLOCK_SIZE);
+    // Defrag right after defrag
+    if ((op == 'O') && (lastDefrag >= 0))
+    {
+      script[i].checkOnly = true;
+      marked++;
+    }
+    if (op == 'O')
+    {
+      lastDefrag = i;
+    }
+    else if (!listing && (op != 'B'))
+    {
+      lastDefrag = -1;
+    }
 
-          lseek(fsfd, BLOCK_SIZE*(startBlockIdx+k), SEEK_SET);
-          write(fsfd, emptyBuff, BLOCK_SIZE);
-        }
+    // Item deleted right after it is created
+    if ((op == 'D') && (lastCreate >= 0) && (createPath == cmd.arg) && (idleDefragBudget == 0))
+    {
+      script[lastCreate].checkOnly = true;
+      script[i].checkOnly = true;
+      marked += 2;
+    }
+    if (op == 'C')
+    {
+      lastCreate = i;
+      createPath = cmd.arg;
+    }
+    else if ((op != 'B') && (op != 0))
+    {
+      lastCreate = -1;
+    }
+  }
+  return marked;
+}
 
-        for (int k=0; k < new_size; k++)
-        {
-          setFreeBlockBit((newStartBlockIdx+k), 1);
-        }
+string diskKey(const char *path)
+{
+  /* Returns a name identifying the file at path however it is written: its
+     canonical path, or that of its directory if it does not exist yet
+  */
+  char resolved[PATH_MAX];
+  if (realpath(path, resolved) != NULL)
+  {
+    return string(resolved);
+  }
+  string dir = path;
+  size_t slash = dir.rfind('/');
+  string base = (slash == string::npos) ? dir : dir.substr(slash + 1);
+  dir = (slash == string::npos) ? "." : (slash == 0) ? "/" : dir.substr(0, slash);
+  if (realpath(dir.c_str(), resolved) != NULL)
+  {
+    return string(resolved) + "/" + base;
+  }
+  return string(path);
+}
 
-        // Clear old mem blocks and free block bits
-        memset(tempBuff, 0, BLOCK_SIZE);
+int streamOf(map<string, int> &streams, vector<int> &streamParent, const char *path)
+{
+  /* Returns the stream using the disk or host file at path, adding one if
+     the file has none yet
+  */
+  string key = diskKey(path);
+  if (streams.count(key) == 0)
+  {
+    streams[key] = streamParent.size();
+    streamParent.push_back(streamParent.size());
+  }
+  return streams[key];
+}
 
-        // Update start block and size
-        superblock.inode[inodeIndex].start_block = newStartBlockIdx;
-        superblock.inode[inodeIndex].used_size = new_size | 0x80;
-      }
-      else
-      {
-        // Not saveable; restore free block bits and print error message
-        strncpy(superblock.free_block_list, tempFreeBlockList, 16);
-        fprintf(stderr, "Error: File %s cannot expand to size %d\n", tempName, new_size);
-      }
-    }
+int findStream(vector<int> &streamParent, int stream)
+{
+  /* Returns the stream that stream was merged into */
+  while (streamParent[stream] != stream)
+  {
+    streamParent[stream] = streamParent[streamParent[stream]];
+    stream = streamParent[stream];
   }
+  return stream;
 }
 
-void fs_defrag(void)
+void mergeStreams(vector<int> &streamParent, int a, int b)
 {
-  /* fs_defrag rearranges file blocks in memory so that there are no free
-     blocks between used blocks, and between the superblock and used blocks.
-     Input: None
-     Output: None
+  /* Merges streams a and b, so their commands run on one worker in order */
+  streamParent[findStream(streamParent, a)] = findStream(streamParent, b);
+}
+
+bool diskMountable(const char *path)
+{
+  /* Checks if the disk at path exists and passes the consistency checks, by
+     mounting it in a child process that exits without writing it back.
   */
-  if (!fsMounted)
+  outFlush();
+  pid_t pid = fork();
+  if (pid == 0)
   {
-    fprintf(stderr, "Error: No file system is mounted\n");
-    return;
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    dup2(devNull, STDERR_FILENO);
+
+    // Mounting must not change the disk
+    compressOnMount = false;
+    dedupEnabled = false;
+    checksumsEnabled = false;
+    char name[MAX_INPUT_LENGTH];
+    strncpy(name, path, MAX_INPUT_LENGTH - 1);
+    name[MAX_INPUT_LENGTH - 1] = '\0';
+    fs_mount(name);
+    _exit(fsMounted ? 0 : 1);
   }
+  int status;
+  return (pid > 0) && (waitpid(pid, &status, 0) == pid) && WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+}
 
-  // Create list of file inodes sorted by smallest start_block to largest
-  priority_queue<int, vector<int>, cmpStartBlock> q;
-  for (int i = 0; i < 126; i++)
+void runStream(const vector<Script_command> &script, const vector<int> &commandStream,
+               const vector<bool> &replayBuffer, int stream, FILE *output, char *filename)
+{
+  /* Worker process of parallel mode: runs the commands of one stream with
+     their output tagged into output, and the B commands of other streams
+     silently so buffers hold what they would in one process. Never returns.
+  */
+  workerOutput = output;
+  Command cmd;
+  for (size_t i = 0; i < script.size(); i++)
   {
-    if (superblock.inode[i].start_block != 0)
+    if (commandStream[i] == stream)
     {
-      q.push(i);
+      parseScriptLine(script[i], &cmd);
+      workerLine = cmd.line;
+      runCommand(&cmd, filename);
+    }
+    else if (replayBuffer[i] && !script[i].checkOnly)
+    {
+      parseScriptLine(script[i], &cmd);
+      uint8_t *target = registerBuffer(cmd.reg);
+      memcpy(target, cmd.data, cmd.length);
+      memset(target + cmd.length, 0, BLOCK_SIZE - cmd.length);
     }
   }
 
-  int firstFreeBlock = 1;
-  while (!q.empty())
+  workerLine = INT_MAX;
+  if (fsMounted)
   {
-    int newStartBlockIdx, fileSize;
-    int inodeIndex = q.top();
-    int startBlockIdx = getStartBlock(inodeIndex);
-    fileSize = getFileSize(inodeIndex);
+    unmountDisk();
+  }
+  stopFlusher();
+  fflush(output);
+  _exit(0);
+}
 
-    while (firstFreeBlock < startBlockIdx)
-    {
-      if (!getFreeBlockBit(firstFreeBlock))
-      {
-        break;
-      }
-      firstFreeBlock++;
-    }
+bool recordBefore(const pair<int, pair<int, string> > &a, const pair<int, pair<int, string> > &b)
+{
+  /* Orders tagged output records by line */
+  return a.first < b.first;
+}
 
-    if (firstFreeBlock >= startBlockIdx) // no need to shift, already at smallest free data block
-    {
-      q.pop();
-      firstFreeBlock = startBlockIdx+fileSize;
-      continue;
-    }
-    else
+bool runStreams(const vector<Script_command> &script, char *filename)
+{
+  /* Splits the script into streams of commands for different disks, from
+     each M to the next, and runs each stream in its own worker process.
+     Streams sharing a file (a disk, snapshot, clone or host file of I and X)
+     or a buffer (W of a buffer last filled by R from another disk) are
+     merged. B commands are repeated silently in every stream. The workers'
+     output is merged back in line order.
+     Input: script - every command of the input file
+            filename - input file, for Command Error messages
+     Output: false, having run nothing, if the script is not worth splitting
+             or cannot be split: G reports totals of all disks, and a disk
+             that fails to mount would leave commands on the previous disk
+  */
+  map<string, int> streams;        // key: disk or host file, val: stream using it
+  vector<int> streamParent(1, 0);  // index: stream, val: stream it was merged into; 0 runs commands before the first M
+  vector<int> commandStream(script.size());
+  vector<bool> replayBuffer(script.size(), false); // B commands run in every stream
+  vector<vector<int> > readers(NUM_REGISTERS + 1); // index: register + 1, val: streams whose R may have filled it since the last B
+  set<string> disks;               // disks mounted by the script
+  int current = 0;
+  string currentDisk;
+  Command cmd;
+
+  for (size_t i = 0; i < script.size(); i++)
+  {
+    parseScriptLine(script[i], &cmd);
+    bool mounted = (current != 0);
+    switch (cmd.op)
     {
-      newStartBlockIdx = firstFreeBlock;
-      char tempBuff[BLOCK_SIZE];
-
-      // Copy over mem blocks and reset old free block list bits
-      for (int j = 0; j < fileSize; j++)
+      case 'M':
+        current = streamOf(streams, streamParent, cmd.arg);
+        currentDisk = cmd.arg;
+        disks.insert(cmd.arg);
+        break;
+      case 'G':
+        return false;
+      case 'N': case 'I': case 'X':
+        if (mounted)
+        {
+          mergeStreams(streamParent, current, streamOf(streams, streamParent, cmd.arg2));
+        }
+        break;
+      case 'S': case 'Z':
+        if (mounted)
+        {
+          mergeStreams(streamParent, current, streamOf(streams, streamParent, (currentDisk + "@" + cmd.arg).c_str()));
+        }
+        break;
+      case 'B':
+        replayBuffer[i] = mounted;
+        if (mounted)
+        {
+          readers[cmd.reg + 1].clear();
+        }
+        break;
+      case 'R':
+        if (mounted)
+        {
+          readers[cmd.reg + 1].push_back(current);
+        }
+        break;
+      case 'W':
+        for (size_t r = 0; mounted && (r < readers[cmd.reg + 1].size()); r++)
+        {
+          mergeStreams(streamParent, current, readers[cmd.reg + 1][r]);
+        }
+        break;
+      case 'V':
       {
-        // Copy oldFileSize+j'th mem block to newStartBlockIdx+j'th block
-        lseek(fsfd, BLOCK_SIZE*(startBlockIdx+j), SEEK_SET);
-        read(fsfd, &tempBuff, BLOCK_SIZE);
-
-        lseek(fsfd, BLOCK_SIZE*(newStartBlockIdx+j), SEEK_SET);
-        write(fsfd, &tempBuff, BLOCK_SIZE);
-
-        // Zero out free block bit and old block that we just copied
-        memset(tempBuff, 0, BLOCK_SIZE);
-        lseek(fsfd, BLOCK_SIZE*(startBlockIdx+j), SEEK_SET);
-        write(fsfd, &tempBuff, BLOCK_SIZE);
-
-        setFreeBlockBit((startBlockIdx+j), 0);
-
-        // newStartBlockIdx should always be lower than startBlockIdx, so set the new free block bit
-        setFreeBlockBit((newStartBlockIdx+j), 1);
+        // Every third word names a register
+        char *savePtr;
+        int word = 0;
+        for (char *tok = strtok_r(cmd.arg, " ", &savePtr); mounted && (tok != NULL); tok = strtok_r(NULL, " ", &savePtr), word++)
+        {
+          for (size_t r = 0; (word % 3 == 0) && (r < readers[atoi(tok) + 1].size()); r++)
+          {
+            mergeStreams(streamParent, current, readers[atoi(tok) + 1][r]);
+          }
+        }
+        break;
       }
-      superblock.inode[inodeIndex].start_block = newStartBlockIdx;
     }
-    firstFreeBlock = newStartBlockIdx+fileSize;
-    q.pop();
+    commandStream[i] = current;
   }
 
-}
-
-void fs_cd(char name[5])
-{
-  /* fs_cd changes current working directory to the one specified.
-     Input: name - name of directory to change into
-     Output: None
-  */
-  if (!fsMounted)
+  for (set<string>::iterator disk = disks.begin(); disk != disks.end(); disk++)
   {
-    fprintf(stderr, "Error: No file system is mounted\n");
-    return;
+    if (!diskMountable(disk->c_str()))
+    {
+      return false;
+    }
   }
 
-  if (strcmp(name, ".") == 0) // current directory
+  // One worker per merged stream, in order of first command
+  vector<int> workerStreams;
+  for (size_t i = 0; i < script.size(); i++)
   {
-    // Already there
-    return;
+    commandStream[i] = findStream(streamParent, commandStream[i]);
+    if (find(workerStreams.begin(), workerStreams.end(), commandStream[i]) == workerStreams.end())
+    {
+      workerStreams.push_back(commandStream[i]);
+    }
   }
-  else if (strcmp(name, "..") == 0) // parent directory
+  if (workerStreams.size() < 2)
   {
-    if (info.currWorkDir == 127)
+    return false;
+  }
+
+  vector<FILE *> outputs(workerStreams.size());
+  int running = 0;
+  bool failed = false;
+  for (size_t w = 0; w <= workerStreams.size(); w++)
+  {
+    // Wait for a worker to finish once all are busy, or for all at the end
+    while ((running > 0) && ((running == parallelWorkers) || (w == workerStreams.size())))
     {
-      // At root; nowhere to go
-      return;
+      int status;
+      wait(&status);
+      failed = failed || !WIFEXITED(status) || (WEXITSTATUS(status) != 0);
+      running--;
     }
-    else
+    if (w == workerStreams.size())
     {
-      // Set current working directory to parent directory of current inode
-      info.currWorkDir = superblock.inode[info.currWorkDir].dir_parent & 0x7F;
+      break;
     }
-  }
-  else // child directory (maybe)
-  {
-    int sharedIdx = getIndexInDir(name);
 
-    if (sharedIdx < 0)
+    outputs[w] = tmpfile();
+    outFlush();
+    pid_t pid = fork();
+    if (pid == 0)
     {
-      fprintf(stderr, "Error: Directory %s does not exist\n", name);
-      return;
+      runStream(script, commandStream, replayBuffer, workerStreams[w], outputs[w], filename);
     }
+    running++;
+  }
 
-     int inodeIndex = getInodeIndex(sharedIdx);
+  // Merge output of the workers by line, keeping each worker's order
+  vector<pair<int, pair<int, string> > > records; // (line, (stream, text))
+  for (size_t w = 0; w < outputs.size(); w++)
+  {
+    rewind(outputs[w]);
+    Tagged_output tag;
+    while (fread(&tag, sizeof(Tagged_output), 1, outputs[w]) == 1)
+    {
+      string text(tag.length, '\0');
+      if ((tag.length > 0) && (fread(&text[0], 1, tag.length, outputs[w]) != (size_t)tag.length))
+      {
+        break;
+      }
+      records.push_back(make_pair(tag.line, make_pair(tag.stream, text)));
+    }
+    fclose(outputs[w]);
+  }
+  stable_sort(records.begin(), records.end(), recordBefore);
+  for (size_t i = 0; i < records.size(); i++)
+  {
+    outAppend(records[i].second.first ? stderr : stdout, records[i].second.second.data(), records[i].second.second.size());
+  }
 
-     // Is it, in fact, a child directory?
-     if (inodeIsDirectory(inodeIndex))
-     {
-       info.currWorkDir = inodeIndex;
-     }
-     else // nah
-     {
-       fprintf(stderr, "Error: Directory %s does not exist\n", name);
-     }
+  if (failed)
+  {
+    outPrintf(stderr, "Error: A worker process failed\n");
   }
+  return true;
 }
 /* ------------------------ END FUNCTION DEFINITIONS ------------------------ */
 
 int main(int argc, char **argv)
 {
-  if (argc != 2)
-  {
-    fprintf(stderr, "Incorrect number of input files provided\n");
-    return -1;
-  }
-
-  memset(buffer, 0, sizeof(buffer));
-
-  char input[MAX_INPUT_LENGTH]; // command from file
-  int lineCounter = 1;
-  char *filename = argv[1];
-
-  // Try opening input file
-  FILE *fp = fopen(filename, "r");
-
-  if (fp == NULL)
+  atexit(outFlush);
+
+  static struct option longOptions[] = {
+    {"durability",     required_argument, 0, 'd'},
+    {"group-commands", required_argument, 0, 'n'},
+    {"group-millis",   required_argument, 0, 't'},
+    {"stats",          no_argument,       0, 's'},
+    {"alloc",          required_argument, 0, 'a'},
+    {"checksums",      no_argument,       0, 'c'},
+    {"compress",       no_argument,       0, 'z'},
+    {"dedup",          no_argument,       0, 'u'},
+    {"trace",          required_argument, 0, 'T'},
+    {"replay",         required_argument, 0, 'P'},
+    {"max-speed",      no_argument,       0, 'm'},
+    {"mkfs",           no_argument,       0, 'k'},
+    {"spec",           required_argument, 0, 'f'},
+    {"pipeline",       no_argument,       0, 'p'},
+    {"output-buffer",  required_argument, 0, 'o'},
+    {"idle-defrag",    required_argument, 0, 'i'},
+    {"heat",           no_argument,       0, 'h'},
+    {"parallel",       required_argument, 0, 'j'},
+    {"optimize",       no_argument,       0, 'O'},
+    {0, 0, 0, 0}
+  };
+
+  // Parse options preceding the input file
+  int opt;
+  char *tracePath = NULL;
+  char *replayPath = NULL;
+  bool maxSpeed = false;
+  bool mkfs = false;
+  char *specPath = NULL;
+  while ((opt = getopt_long(argc, argv, "d:n:t:sa:czuT:P:mkf:po:i:hj:O", longOptions, NULL)) != -1)
   {
-    fprintf(stderr, "Could not open input file\n");
-    return -1;
-  }
-
-  // Read input file line by line
-  while (fgets(input, sizeof(input), fp) != NULL) {
-    char *tokArgs[MAX_INPUT_LENGTH] = {NULL};
-
-    // Ignore line if just a newline character
-    if (input[0] == '\n')
+    if (opt == 'd')
     {
-      lineCounter++;
-      continue;
+      if (strcmp(optarg, "none") == 0) syncState.mode = DURABILITY_NONE;
+      else if (strcmp(optarg, "command") == 0) syncState.mode = DURABILITY_COMMAND;
+      else if (strcmp(optarg, "group") == 0) syncState.mode = DURABILITY_GROUP;
+      else if (strcmp(optarg, "unmount") == 0) syncState.mode = DURABILITY_UNMOUNT;
+      else
+      {
+        outPrintf(stderr, "Unknown durability mode %s\n", optarg);
+        return -1;
+      }
     }
-
-    // Remove trailing newline char
-    size_t len = strlen(input);
-    if (len > 0 && input[len - 1] == '\n')
+    else if (opt == 'n')
     {
-      input[len - 1] = '\0';
+      syncState.groupCommands = atoi(optarg);
     }
-
-    // Split into space-separated strings
-    tokenize(&input[0], " ", &tokArgs[0]);
-
-    // Check to see if proper command format and execute
-    if (strcmp(tokArgs[0], "M") == 0)
+    else if (opt == 't')
     {
-      // Should only have one arg
-      if (tokArgs[2] != NULL || tokArgs[1] == NULL)
-      {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-      }
-      else
-      {
-        fs_mount(tokArgs[1]);
-      }
+      syncState.groupMillis = atoi(optarg);
     }
-    else if (strcmp(tokArgs[0], "C") == 0)
+    else if (opt == 's')
     {
-      // Should only have two args
-      if (tokArgs[3] != NULL || tokArgs[1] == NULL || tokArgs[2] == NULL)
-      {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-      }
-      // Check if filename longer than 5 chars
-      else if (strlen(tokArgs[1]) > 5)
-      {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-      }
-      else
-      {
-        int size = atoi(tokArgs[2]);
-        if (size < 0 || size > 127)  // no way can we have a file of this size
-        {
-          fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-        }
-        else
-        {
-          fs_create(tokArgs[1], size);
-        }
-      }
+      stats.enabled = true;
     }
-    else if (strcmp(tokArgs[0], "D") == 0)
+    else if (opt == 'c')
     {
-      // Should only have one arg
-      if (tokArgs[2] != NULL || tokArgs[1] == NULL)
-      {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-      }
-      // Check if filename longer than 5 chars
-      else if (strlen(tokArgs[1]) > 5)
-      {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-      }
-      else
-      {
-        fs_delete(tokArgs[1]);
-      }
+      checksumsEnabled = true;
     }
-    else if (strcmp(tokArgs[0], "R") == 0)
+    else if (opt == 'z')
     {
-      // Should only have two args
-      if (tokArgs[3] != NULL || tokArgs[1] == NULL || tokArgs[2] == NULL)
-      {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-      }
-      // Check if filename longer than 5 chars
-      else if (strlen(tokArgs[1]) > 5)
-      {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-      }
-      else
-      {
-        int block_num = atoi(tokArgs[2]);
-        // Block number  must be in range [0, 126]
-        if ( (block_num > 126) || (block_num < 0) )
-        {
-          fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-        }
-        else
-        {
-          fs_read(tokArgs[1], block_num);
-        }
-      }
+      compressOnMount = true;
     }
-    else if (strcmp(tokArgs[0], "W") == 0)
+    else if (opt == 'u')
     {
-      // Should only have two args
-      if (tokArgs[3] != NULL || tokArgs[1] == NULL || tokArgs[2] == NULL)
-      {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-      }
-      // Check if filename longer than 5 chars
-      else if (strlen(tokArgs[1]) > 5)
-      {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-      }
-      else
-      {
-        int block_num = atoi(tokArgs[2]);
-        // Block number must be in range [0, 126]
-        if ( (block_num > 126) || (block_num < 0) )
-        {
-          fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-        }
-        else
-        {
-          fs_write(tokArgs[1], block_num);
-        }
-      }
+      dedupEnabled = true;
     }
-    else if (strcmp(tokArgs[0], "B") == 0)
+    else if (opt == 'T')
     {
-      // Should only have two args
-      if (tokArgs[2] != NULL || tokArgs[1] == NULL)
-      {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-      }
-      // Check if filename longer than 1024 chars
-      else if (strlen(tokArgs[1]) > BLOCK_SIZE)
-      {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-      }
-      else
-      {
-        uint8_t tempBuff[BLOCK_SIZE];
-        memcpy(tempBuff, tokArgs[1], BLOCK_SIZE);
-        fs_buff(tempBuff);
-      }
+      tracePath = optarg;
     }
-    else if (strcmp(tokArgs[0], "L") == 0)
+    else if (opt == 'P')
     {
-      // Should have no args
-      if (tokArgs[1] != NULL)
-      {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-      }
-      else
-      {
-        fs_ls();
-      }
+      replayPath = optarg;
     }
-    else if (strcmp(tokArgs[0], "E") == 0)
+    else if (opt == 'm')
     {
-      // Should only have two args
-      if (tokArgs[3] != NULL || tokArgs[1] == NULL || tokArgs[2] == NULL)
-      {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-      }
-      // Check if filename longer than 5 chars
-      else if (strlen(tokArgs[1]) > 5)
-      {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-      }
-      else
-      {
-        int size = atoi(tokArgs[2]);
-        if (size < 1) // assumption
-        {
-          fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-        }
-        else
-        {
-          fs_resize(tokArgs[1], size);
-        }
-      }
+      maxSpeed = true;
+    }
+    else if (opt == 'k')
+    {
+      mkfs = true;
+    }
+    else if (opt == 'f')
+    {
+      specPath = optarg;
+    }
+    else if (opt == 'p')
+    {
+      pipelined = true;
+    }
+    else if (opt == 'o')
+    {
+      outBufferSize = max(atoi(optarg), 0);
+    }
+    else if (opt == 'h')
+    {
+      heatPlacement = true;
+    }
+    else if (opt == 'O')
+    {
+      optimize = true;
     }
-    else if (strcmp(tokArgs[0], "O") == 0)
+    else if (opt == 'j')
     {
-      // Should have no args
-      if (tokArgs[1] != NULL)
+      // 0 runs as many workers at once as there are cores
+      parallelWorkers = atoi(optarg);
+      if (parallelWorkers <= 0)
       {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
+        parallelWorkers = max((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
       }
+    }
+    else if (opt == 'i')
+    {
+      // Idle time is seen by the executor thread waiting for commands
+      idleDefragBudget = max(atoi(optarg), 0);
+      pipelined = true;
+    }
+    else if (opt == 'a')
+    {
+      if (strcmp(optarg, "first") == 0) allocPolicy = ALLOC_FIRST_FIT;
+      else if (strcmp(optarg, "next") == 0) allocPolicy = ALLOC_NEXT_FIT;
+      else if (strcmp(optarg, "best") == 0) allocPolicy = ALLOC_BEST_FIT;
+      else if (strcmp(optarg, "worst") == 0) allocPolicy = ALLOC_WORST_FIT;
+      else if (strcmp(optarg, "buddy") == 0) allocPolicy = ALLOC_BUDDY;
       else
       {
-        fs_defrag();
+        outPrintf(stderr, "Unknown allocation policy %s\n", optarg);
+        return -1;
       }
     }
-    else if (strcmp(tokArgs[0], "Y") == 0)
+    else
     {
-      // Should only have one arg
-      if (tokArgs[2] != NULL || tokArgs[1] == NULL)
-      {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-      }
-      // Check if filename longer than 5 chars
-      else if (strlen(tokArgs[1]) > 5)
-      {
-        fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
-      }
-      else
+      return -1;
+    }
+  }
+
+  // In image creation mode every argument is a disk image to create, all
+  // sharing one superblock built from the spec
+  if (mkfs)
+  {
+    if (argc == optind)
+    {
+      outPrintf(stderr, "Incorrect number of input files provided\n");
+      return -1;
+    }
+    if (!buildImageSuperblock(specPath))
+    {
+      return -1;
+    }
+    for (int i = optind; i < argc; i++)
+    {
+      if (createImage(argv[i]) != 0)
       {
-        fs_cd(tokArgs[1]);
+        return -1;
       }
     }
+    return 0;
+  }
+
+  if (argc - optind != 1)
+  {
+    outPrintf(stderr, "Incorrect number of input files provided\n");
+    return -1;
+  }
+
+  // In replay mode the only argument is the disk image to replay against
+  if (replayPath != NULL)
+  {
+    return replayTrace(replayPath, argv[optind], maxSpeed);
+  }
+
+  if (tracePath != NULL)
+  {
+    tracer.fd = open(tracePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (tracer.fd < 0)
+    {
+      outPrintf(stderr, "Could not open trace file %s\n", tracePath);
+      return -1;
+    }
+    Trace_header header;
+    memset(&header, 0, sizeof(Trace_header));
+    strncpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.recordSize = sizeof(Trace_record);
+    if (write(tracer.fd, &header, sizeof(Trace_header)) != (int)sizeof(Trace_header))
+    {
+      outPrintf(stderr, "Could not write trace file %s\n", tracePath);
+      return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tracer.start);
+  }
+
+  // Statistics, traces and idle time span all disks, so need one process
+  if (stats.enabled || (tracer.fd >= 0) || (idleDefragBudget > 0))
+  {
+    parallelWorkers = 0;
+  }
+  if (parallelWorkers > 0)
+  {
+    pipelined = false;
+  }
+
+  memset(buffer, 0, sizeof(buffer));
+
+  char input[MAX_PAYLOAD_LENGTH]; // command from file, over several lines for encoded B payloads
+  int lineCounter = 1;
+  char *filename = argv[optind];
+
+  // Try opening input file
+  FILE *fp = fopen(filename, "r");
+
+  if (fp == NULL)
+  {
+    outPrintf(stderr, "Could not open input file\n");
+    return -1;
+  }
+
+  pthread_t executor, writer;
+  if (pipelined)
+  {
+    pthread_create(&writer, NULL, writeOutput, NULL);
+    outputThreadRunning = true;
+    pthread_create(&executor, NULL, executeCommands, filename);
+  }
+
+  // Read input file command by command
+  int commandLine;
+  bool wholeScript = (parallelWorkers > 0) || optimize;
+  vector<Script_command> script; // commands of input file, if it is read whole first
+  while (readCommand(fp, input, sizeof(input), &lineCounter, &commandLine))
+  {
+    // Check to see if proper command format and execute, or queue it for
+    // the executor thread, or keep it to optimize or split into streams
+    if (wholeScript)
+    {
+      Script_command scriptLine = {commandLine, string(input), false};
+      script.push_back(scriptLine);
+    }
+    else if (pipelined)
+    {
+      Command *cmd = &commandRing[ringReserve(&commandQueue, COMMAND_RING_SIZE)];
+      parseCommand(input, commandLine, cmd);
+      ringPublish(&commandQueue);
+    }
     else
     {
-      // Not valid command
-      fprintf(stderr, "Command Error: %s, %d\n", filename, lineCounter);
+      Command cmd;
+      parseCommand(input, commandLine, &cmd);
+      runCommand(&cmd, filename);
     }
-    // increment line counter
-    lineCounter++;
   }
 
   // Close input file
   fclose(fp);
 
-  // Close mounted disk file if open
+  if (optimize)
+  {
+    stats.checkOnlyCommands = peephole(script);
+  }
+  if (wholeScript && !((parallelWorkers > 0) && runStreams(script, filename)))
+  {
+    // Run the script in order, if it was not split into streams
+    for (size_t i = 0; i < script.size(); i++)
+    {
+      if (pipelined)
+      {
+        Command *cmd = &commandRing[ringReserve(&commandQueue, COMMAND_RING_SIZE)];
+        parseScriptLine(script[i], cmd);
+        ringPublish(&commandQueue);
+      }
+      else
+      {
+        Command cmd;
+        parseScriptLine(script[i], &cmd);
+        runCommand(&cmd, filename);
+      }
+    }
+  }
+
+  if (pipelined)
+  {
+    // Mark end of input and wait for queued commands and output to drain
+    commandRing[ringReserve(&commandQueue, COMMAND_RING_SIZE)].line = 0;
+    ringPublish(&commandQueue);
+    pthread_join(executor, NULL);
+    pthread_join(writer, NULL);
+    outputThreadRunning = false;
+    pipelined = false;
+  }
+  tracer.command = 0;
+  traceFile(-1, -1);
+
+  // Close mounted disk file if open, and wait for all disks to be written
   if (fsMounted)
   {
-    lseek(fsfd, 0, SEEK_SET);
-    write(fsfd, &superblock, BLOCK_SIZE);
-    close(fsfd);
+    unmountDisk();
+  }
+  stopFlusher();
+
+  if (stats.enabled)
+  {
+    printStats();
+  }
+
+  if (tracer.fd >= 0)
+  {
+    traceFlush();
+    close(tracer.fd);
   }
 
   return 0;